@@ -0,0 +1,70 @@
+#ifndef ADAPTIVE_PULSE_DETECTOR_H
+#define ADAPTIVE_PULSE_DETECTOR_H
+
+#include "PulseExtremaDetector.h"
+
+template<typename T, std::size_t MaxLookahead>
+class AdaptivePulseDetector {
+    /*
+    * PulseExtremaDetector with a lookahead chosen at runtime, between 1 and
+    * MaxLookahead. One instantiation serves pumps with different pulse
+    * periods, and the window follows the measured samples per pulse.
+    *
+    * retune() picks just under half the samples per pulse: the
+    * neighbouring extremum of the same type is two pulses away, so the
+    * window never spans two peaks, while it is still wide enough to ride
+    * over noise. A run stops lookahead samples after its last pulse and the
+    * next run can only detect from its lookahead-th sample on, so the
+    * lookahead stays below half a pulse to catch the first pulse of the
+    * next run. Detection latency is the lookahead, so shorter pulses also
+    * report faster.
+    *
+    * A window much wider than the pulses misses pulses, which then makes
+    * the samples per pulse look larger, so give MonitoredPump a rough
+    * approxSamplesPerPulse to start from. Until then MaxLookahead is used.
+    *
+    * Same interface as PulseExtremaDetector, which stays the fastest path
+    * (fixed window, constexpr centerOffset).
+    */
+public:
+    static_assert(MaxLookahead > 0, "MaxLookahead must be at least 1");
+    static constexpr std::size_t Capacity = 2 * MaxLookahead + 1;
+
+    AdaptivePulseDetector() : lookahead_(MaxLookahead) {}
+
+    // Sets the lookahead (clamped to 1..MaxLookahead) and clears the detector
+    void setLookahead(std::size_t lookahead) {
+        if (lookahead < 1) lookahead = 1;
+        if (lookahead > MaxLookahead) lookahead = MaxLookahead;
+        lookahead_ = lookahead;
+        clear();
+    }
+    std::size_t lookahead() const { return lookahead_; }
+
+    // lookahead for the given samples per pulse, 0 keeps the current one
+    void retune(uint32_t samplesPerPulse) {
+        if (samplesPerPulse == 0) return;
+        setLookahead((samplesPerPulse - 1) / 2);
+    }
+
+    PulseType addSample(T sample) {
+        return core_.addSample(sample, lookahead_);
+    }
+
+    T peakValue() const { return core_.peakValue(); }
+    T troughValue() const { return core_.troughValue(); }
+    float pulseOffset() const { return core_.pulseOffset(); }
+    float pulseValue() const { return core_.pulseValue(); }
+
+    std::size_t centerOffset() const {
+        return lookahead_;
+    }
+
+    void clear() { core_.clear(); }
+
+private:
+    PulseExtremaCore<T, MaxLookahead> core_;
+    std::size_t lookahead_;
+};
+
+#endif // ADAPTIVE_PULSE_DETECTOR_H
@@ -1,126 +1,170 @@
-
 #ifndef ASYNCH_MONITORED_PUMP_H
 #define ASYNCH_MONITORED_PUMP_H
 
 #include "MonitoredPump.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
+#include "PumpHal.h"
 #include <atomic>
 
-template <std::size_t Lookahead>
-class AsyncMonitoredPump : public MonitoredPump<Lookahead> {
+template <std::size_t Lookahead, typename Detector = PulseExtremaDetector<int32_t,Lookahead>, typename Filter = NoFilter>
+class AsyncMonitoredPump : public MonitoredPump<Lookahead, Detector, Filter> {
+    /*
+    * Runs the pump from a worker task, so runForPulses/runForMl return
+    * right away. The worker is created with the first run and then stays,
+    * sleeping on a task notification between runs: starting a dose costs
+    * no task creation and no heap. stop() cuts the power at once and the
+    * worker ends the run at its next sample; waitFinished() (or
+    * completion().wait()) blocks until the run is over instead of polling
+    * isFinished(). A request that can't run completes at once with the
+    * reason in lastResult(), e.g. RunResult::StartFailed.
+    */
 public:
     AsyncMonitoredPump(uint8_t enablePin, uint8_t touchPin, float pulsesPerMl,
                         size_t approxSamplesPerPulse = 0)
-        : MonitoredPump<Lookahead>(enablePin, touchPin, pulsesPerMl, approxSamplesPerPulse),
-          taskHandle_(nullptr), pulseTarget_(0), doFullDiagnostics_(false), 
-          running_(false) {}
+        : MonitoredPump<Lookahead, Detector, Filter>(enablePin, touchPin, pulsesPerMl, approxSamplesPerPulse),
+          taskHandle_(nullptr), pulseTarget_(0), doFullDiagnostics_(false) {}
 
-    AsyncMonitoredPump(AsyncMonitoredPump&&) = default; //for move semantics
+    // ends the worker task, waits until it no longer uses the pump
+    ~AsyncMonitoredPump();
 
     bool runForMl(float ml, bool fullDiagnostics = false) override;
 
-    // Kick off a background run, overrides runForPulses in MonitoredPump
+    // Kick off a background run, overrides runForPulses in MonitoredPump.
+    // There is no abort flag, the run is aborted with stop().
     bool runForPulses(uint32_t pulses, bool fullDiagnostics = false, std::atomic<bool>* abortFlag = nullptr) override;
 
     // Check if the task has completed
     bool isFinished() const override {
-        return !running_.load();
+        return this->completion_.ready();
     }
 
     // compatibility to other pump classes
     bool isBusy() const override {
-        return running_.load();
+        return !this->completion_.ready();
+    }
+
+    // Blocks until the current run (if any) is over, returns false on
+    // timeout. The result is in lastResult() and getDiagnostics() then.
+    bool waitFinished(uint32_t timeoutMs = pumphal::WaitForever) {
+        return this->completion_.wait(timeoutMs);
     }
 
     void stop() override;
 
 private:
+    bool startWorker();
+
     static void taskFunc(void* param) {
         AsyncMonitoredPump* self = static_cast<AsyncMonitoredPump*>(param);
-        // not needed esp_task_wdt_add(NULL);  // Register with watchdog
-        self->running_.store(true);
-        self->MonitoredPump<Lookahead>::runForPulses(self->pulseTarget_, self->doFullDiagnostics_, &self->abort_);//feed watchdog
-        self->running_.store(false);
-        // not needed esp_task_wdt_delete(NULL);//unregister
-        taskENTER_CRITICAL(&(self->localMux_));
-        self->taskHandle_ = nullptr;
-        taskEXIT_CRITICAL(&(self->localMux_));
-        vTaskDelete(NULL);
+        while (true) {
+            self->wake_.wait();//blocks on the notification - ok for watchdog
+            if (self->quit_.load(std::memory_order_acquire)) {
+                break;
+            }
+            if (!self->startPending_.exchange(false, std::memory_order_acquire)) {
+                continue;//no new run, e.g. a stop between runs
+            }
+            if (self->abort_.load(std::memory_order_acquire)) {
+                //stopped before the run began, the pump is never switched on
+                self->rejectRun(RunResult::Aborted);
+                continue;
+            }
+            //a stop() from here on ends the run at its next sample
+            //completes the request, also if it is refused
+            self->MonitoredPump<Lookahead, Detector, Filter>::runForPulses(self->pulseTarget_, self->doFullDiagnostics_, &self->abort_);
+        }
+        //The last access to self: once the destructor sees it, it frees the
+        //object and deletes this task. Nothing that lives in the object may
+        //be used after it, an event set here could still be in use when
+        //the destructor deletes it.
+        self->parked_.store(true, std::memory_order_release);
+        pumphal::parkCurrentTask();
     }
 
-    TaskHandle_t taskHandle_;
+    pumphal::TaskHandle taskHandle_;
     uint32_t pulseTarget_;
     bool doFullDiagnostics_;
-    mutable std::atomic<bool> abort_{false}; 
-    mutable std::atomic<bool> running_{false};
-    portMUX_TYPE localMux_ = portMUX_INITIALIZER_UNLOCKED;
+    mutable std::atomic<bool> abort_{false};
+    std::atomic<bool> startPending_{false};
+    std::atomic<bool> quit_{false};
+    pumphal::TaskNotifier wake_;
+    std::atomic<bool> parked_{false};   // the worker no longer touches the object
 
 };
 
 
-template <std::size_t Lookahead>
-bool AsyncMonitoredPump<Lookahead>::runForMl(float ml, bool fullDiagnostics) {
-    if (isBusy()) return false; // already running
-    if (!this->volumeSupported(ml)) return false; // not enough pulses
-    //get no of pulses
-    float pulsesNeeded = ml * this->pulsesPerMl();
-    return runForPulses(pulsesNeeded, fullDiagnostics);
+template <std::size_t Lookahead, typename Detector, typename Filter>
+AsyncMonitoredPump<Lookahead, Detector, Filter>::~AsyncMonitoredPump() {
+    if (!taskHandle_) return;
+    stop();
+    quit_.store(true, std::memory_order_release);
+    wake_.notify();
+    //no timeout: the worker must be done with this object before it goes
+    while (!parked_.load(std::memory_order_acquire)) {
+        pumphal::delay(1);
+    }
+    pumphal::deleteTask(taskHandle_);
 }
 
-template <std::size_t Lookahead>
-bool AsyncMonitoredPump<Lookahead>::runForPulses(uint32_t pulses, bool fullDiagnostics, std::atomic<bool>* abortFlag) {
-    if (isBusy()) return false; // already running
-    running_.store(true);//set the flag here
-    abort_.store(false, std::memory_order_release);// reset abort flag
-    
-    pulseTarget_ = pulses;
-    doFullDiagnostics_ = fullDiagnostics;
-
-    BaseType_t result = xTaskCreatePinnedToCore(
+template <std::size_t Lookahead, typename Detector, typename Filter>
+bool AsyncMonitoredPump<Lookahead, Detector, Filter>::startWorker() {
+    if (taskHandle_) return true;
+    bool created = pumphal::createTask(
         taskFunc,               // Function
-        nullptr , // Name, 
+        nullptr , // Name,
         8192,                   // Stack size in bytes
         this,                   // Pass this pointer
         1,                      // Priority
         &taskHandle_,           // Task handle out
         0                       // Core 0, arduino core uses core 1
     );
+    if (!created) {
+        taskHandle_ = nullptr;
+        return false;
+    }
+    wake_.setTask(taskHandle_);
+    return true;
+}
+
+template <std::size_t Lookahead, typename Detector, typename Filter>
+bool AsyncMonitoredPump<Lookahead, Detector, Filter>::runForMl(float ml, bool fullDiagnostics) {
+    if (isBusy()) return false; // already running
+    if (!this->volumeSupported(ml)) { // not enough pulses
+        this->rejectRun(RunResult::InvalidRequest);
+        return false;
+    }
+    //get no of pulses
+    float pulsesNeeded = ml * this->pulsesPerMl();
+    return runForPulses(pulsesNeeded, fullDiagnostics);
+}
 
-    if (result != pdPASS) {
+template <std::size_t Lookahead, typename Detector, typename Filter>
+bool AsyncMonitoredPump<Lookahead, Detector, Filter>::runForPulses(uint32_t pulses, bool fullDiagnostics, std::atomic<bool>* /*abortFlag*/) {
+    if (isBusy()) return false; // already running, the request is dropped
+    if (!startWorker()) {
+        this->rejectRun(RunResult::StartFailed);
         return false;
     }
+    this->completion_.reset();//busy from here on
+    abort_.store(false, std::memory_order_release);// reset abort flag
+
+    pulseTarget_ = pulses;
+    doFullDiagnostics_ = fullDiagnostics;
+    //publishes the parameters above to the worker
+    startPending_.store(true, std::memory_order_release);
+    wake_.notify();
     return true;//all good
 }
 
-template <std::size_t Lookahead>
-void AsyncMonitoredPump<Lookahead>::stop() {
-     if (!running_.load()) return;           // nothing to do
+template <std::size_t Lookahead, typename Detector, typename Filter>
+void AsyncMonitoredPump<Lookahead, Detector, Filter>::stop() {
+    if (isFinished()) return;               // nothing to do
 
     abort_.store(true, std::memory_order_release); // ask worker to exit
+    //cut the power now, not only when the worker sees the flag
+    MonitoredPump<Lookahead, Detector, Filter>::stop();
 
-    TaskHandle_t h;
-    taskENTER_CRITICAL(&localMux_);
-    h = taskHandle_;                        // copy under lock
-    taskEXIT_CRITICAL(&localMux_);
-
-    /*  Wait (max 1 s) until the task sets taskHandle_ = nullptr in
-        its epilogue.  The loop also feeds the WDT.                   */
-    uint32_t deadline = millis() + 1000;
-    while (h && millis() < deadline) {
-        vTaskDelay(pdMS_TO_TICKS(10));
-        taskENTER_CRITICAL(&localMux_);
-        h = taskHandle_;
-        taskEXIT_CRITICAL(&localMux_);
-    }
-
-    /*  If the worker has *already* deleted itself, h is nullptr and
-        we’re done.  If it is still alive (timeout), fall back to a
-        forced delete but only when the state is not eDeleted yet.   */
-    if (h && eTaskGetState(h) != eDeleted) {
-        vTaskDelete(h);
-    }
-    running_.store(false);
+    // the worker ends the run within one sample period
+    waitFinished(1000);
 }
 
 
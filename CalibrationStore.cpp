@@ -0,0 +1,60 @@
+#include "CalibrationStore.h"
+
+#if defined(ARDUINO)
+
+#include <Preferences.h>
+
+bool NvsCalibrationStore::load(const char* key, PumpCalibration& calibration) {
+    Preferences prefs;
+    if (!prefs.begin(nameSpace_, true)) return false; // namespace not written yet
+    PumpCalibration stored;
+    size_t n = prefs.getBytes(key, &stored, sizeof(stored));
+    prefs.end();
+    if (n != sizeof(stored) || stored.magic != PumpCalibration::Magic) return false;
+    calibration = stored;
+    return true;
+}
+
+bool NvsCalibrationStore::save(const char* key, const PumpCalibration& calibration) {
+    Preferences prefs;
+    if (!prefs.begin(nameSpace_, false)) return false;
+    size_t n = prefs.putBytes(key, &calibration, sizeof(calibration));
+    prefs.end();
+    return n == sizeof(calibration);
+}
+
+#else
+
+#include <cstdio>
+
+std::string FileCalibrationStore::path(const char* key) const {
+    return directory_ + "/" + key + ".cal";
+}
+
+bool FileCalibrationStore::load(const char* key, PumpCalibration& calibration) {
+    FILE* f = std::fopen(path(key).c_str(), "rb");
+    if (!f) return false;
+    PumpCalibration stored;
+    size_t n = std::fread(&stored, 1, sizeof(stored), f);
+    std::fclose(f);
+    if (n != sizeof(stored) || stored.magic != PumpCalibration::Magic) return false;
+    calibration = stored;
+    return true;
+}
+
+bool FileCalibrationStore::save(const char* key, const PumpCalibration& calibration) {
+    // write a temporary file and rename it, so a crash never leaves half a record
+    const std::string target = path(key);
+    const std::string temp = target + ".tmp";
+    FILE* f = std::fopen(temp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = std::fwrite(&calibration, 1, sizeof(calibration), f) == sizeof(calibration);
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok || std::rename(temp.c_str(), target.c_str()) != 0) {
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
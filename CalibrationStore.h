@@ -0,0 +1,61 @@
+#ifndef CALIBRATION_STORE_H
+#define CALIBRATION_STORE_H
+
+#include "PumpHealth.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Everything a MonitoredPump learns over its runs, so the first run after
+// a reboot starts from the same state as the last one before it.
+struct PumpCalibration {
+    static constexpr uint32_t Magic = 0x314c4143; // "CAL1"
+    uint32_t magic = Magic;
+    uint32_t baseline = 0;           // touch value of the idle signal
+    uint32_t samplesPerPulse = 0;
+    int32_t stopOffsetUs = 0;        // predictive stop correction
+    float pulsesPerMlCorrection = 1; // measured / nominal pulses per ml
+    PumpProfile profile;             // amplitude and period of a healthy pump
+};
+
+/*
+* Persistent storage for PumpCalibration records, one per key (e.g. the
+* pump name). On the ESP32 NvsCalibrationStore keeps them in NVS via
+* Preferences, on the host FileCalibrationStore keeps one file per key.
+*/
+class CalibrationStore {
+public:
+    virtual ~CalibrationStore() = default;
+    // false if there is no valid record for the key
+    virtual bool load(const char* key, PumpCalibration& calibration) = 0;
+    virtual bool save(const char* key, const PumpCalibration& calibration) = 0;
+};
+
+#if defined(ARDUINO)
+
+// NVS namespace of at most 15 characters, keys as well
+class NvsCalibrationStore : public CalibrationStore {
+public:
+    explicit NvsCalibrationStore(const char* nameSpace = "pumpcal") : nameSpace_(nameSpace) {}
+    bool load(const char* key, PumpCalibration& calibration) override;
+    bool save(const char* key, const PumpCalibration& calibration) override;
+private:
+    const char* nameSpace_;
+};
+
+#else
+
+// one "<key>.cal" file per pump in an existing directory
+class FileCalibrationStore : public CalibrationStore {
+public:
+    explicit FileCalibrationStore(const std::string& directory) : directory_(directory) {}
+    bool load(const char* key, PumpCalibration& calibration) override;
+    bool save(const char* key, const PumpCalibration& calibration) override;
+private:
+    std::string path(const char* key) const;
+    std::string directory_;
+};
+
+#endif
+
+#endif // CALIBRATION_STORE_H
@@ -0,0 +1,351 @@
+#ifndef DIAGNOSTICS_FORMAT_H
+#define DIAGNOSTICS_FORMAT_H
+
+#include "MonitoredPump.h"
+#include <algorithm>
+#include <cstring>
+
+/*
+* Versioned binary format for PumpDiagnostics.
+*
+*   header   "PMPD", version (1 byte), flags (1 byte), 2 bytes reserved
+*   summary  pulse count, missed samples, baseline, interval and amplitude
+*            statistics, interval histogram, predictive stop result
+*   history  (flag History) pulse times as varint deltas, values as float
+*   shape    (flag Shape) the ShapeTrace buffers as they are in memory
+*   trailer  CRC32 of everything before it
+*
+* Integers are LEB128 varints (zigzag for signed values), floats are 4 byte
+* little endian IEEE 754. The writer streams straight from the diagnostics
+* into any sink with write(const uint8_t*, size_t), e.g. an Arduino Serial
+* or File, without building the message in memory first.
+*/
+
+namespace diagformat {
+
+static constexpr uint8_t Magic[4] = {'P', 'M', 'P', 'D'};
+static constexpr uint8_t Version = 1;
+
+enum Flags : uint8_t {
+    History = 1 << 0,
+    Shape = 1 << 1
+};
+
+enum class Error : uint8_t {
+    None = 0,
+    Truncated,    // the source ended early
+    BadMagic,
+    BadVersion,   // written by a newer version
+    BadData,      // inconsistent content
+    BadCrc
+};
+
+// CRC-32 (IEEE, as in zlib), nibble table to keep flash use small
+class Crc32 {
+public:
+    void update(const uint8_t* data, std::size_t size) {
+        static const uint32_t table[16] = {
+            0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+            0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+            0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+            0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+        for (std::size_t i = 0; i < size; ++i) {
+            crc_ ^= data[i];
+            crc_ = table[crc_ & 0x0f] ^ (crc_ >> 4);
+            crc_ = table[crc_ & 0x0f] ^ (crc_ >> 4);
+        }
+    }
+    uint32_t value() const { return ~crc_; }
+private:
+    uint32_t crc_ = 0xffffffff;
+};
+
+template<typename Sink>
+class Writer {
+public:
+    explicit Writer(Sink& sink) : sink_(sink), written_(0) {}
+
+    // returns the number of bytes written
+    std::size_t write(const PumpDiagnostics& d, uint8_t flags = History | Shape) {
+        if (d.pulseTimes.empty()) flags &= ~History;
+        if (d.fullShape.empty()) flags &= ~Shape;
+        written_ = 0;
+        crc_ = Crc32();
+
+        const uint8_t header[8] = {Magic[0], Magic[1], Magic[2], Magic[3], Version, flags, 0, 0};
+        put(header, sizeof(header));
+
+        varint(d.pulseCount());
+        varint(d.missedSamples);
+        varint(static_cast<uint32_t>(d.baseline));
+        stats(d.intervalStats);
+        stats(d.amplitudeStats);
+        varint(d.intervalHistogram.binWidth());
+        for (std::size_t i = 0; i < IntervalHistogram::Bins; ++i) {
+            varint(d.intervalHistogram[i]);
+        }
+        const uint8_t stop = (d.predictedStop ? 1 : 0) | (d.lastPulseMissed ? 2 : 0);
+        put(&stop, 1);
+        varint(ShapeTrace::zigzag(d.stopErrorUs));
+
+        if (flags & History) {
+            const std::size_t n = d.pulseTimes.size() < d.valuesAtPulses.size()
+                                      ? d.pulseTimes.size() : d.valuesAtPulses.size();
+            varint(static_cast<uint32_t>(n));
+            unsigned long last = 0;
+            for (std::size_t i = 0; i < n; ++i) {
+                // wrapping 32 bit difference, intervals are positive
+                varint(static_cast<uint32_t>(d.pulseTimes[i] - last));
+                last = d.pulseTimes[i];
+            }
+            for (std::size_t i = 0; i < n; ++i) {
+                real(d.valuesAtPulses[i]);
+            }
+        }
+        if (flags & Shape) {
+            const std::vector<uint8_t>& samples = d.fullShape.encodedSamples();
+            const std::vector<uint8_t>& pulses = d.fullShape.encodedPulses();
+            varint(static_cast<uint32_t>(d.fullShape.size()));
+            varint(static_cast<uint32_t>(d.fullShape.pulseCount()));
+            varint(static_cast<uint32_t>(samples.size()));
+            put(samples.data(), samples.size());
+            varint(static_cast<uint32_t>(pulses.size()));
+            put(pulses.data(), pulses.size());
+        }
+
+        uint8_t crc[4];
+        le32(crc, crc_.value());
+        sink_.write(crc, sizeof(crc));
+        written_ += sizeof(crc);
+        return written_;
+    }
+
+private:
+    void put(const uint8_t* data, std::size_t size) {
+        if (size == 0) return;
+        sink_.write(data, size);
+        crc_.update(data, size);
+        written_ += size;
+    }
+    void varint(uint32_t v) {
+        uint8_t buf[5];
+        std::size_t n = 0;
+        while (v >= 0x80) {
+            buf[n++] = static_cast<uint8_t>(v | 0x80);
+            v >>= 7;
+        }
+        buf[n++] = static_cast<uint8_t>(v);
+        put(buf, n);
+    }
+    void real(float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        uint8_t buf[4];
+        le32(buf, bits);
+        put(buf, sizeof(buf));
+    }
+    void stats(const RunningStats& s) {
+        varint(s.count());
+        real(s.mean());
+        real(s.deviation());
+        real(s.lowest());
+        real(s.highest());
+    }
+    static void le32(uint8_t* out, uint32_t v) {
+        out[0] = static_cast<uint8_t>(v);
+        out[1] = static_cast<uint8_t>(v >> 8);
+        out[2] = static_cast<uint8_t>(v >> 16);
+        out[3] = static_cast<uint8_t>(v >> 24);
+    }
+
+    Sink& sink_;
+    Crc32 crc_;
+    std::size_t written_;
+};
+
+// convenience, deduces the sink type
+template<typename Sink>
+std::size_t write(Sink& sink, const PumpDiagnostics& d, uint8_t flags = History | Shape) {
+    return Writer<Sink>(sink).write(d, flags);
+}
+
+// sink collecting into a byte vector
+struct VectorSink {
+    std::vector<uint8_t> data;
+    void write(const uint8_t* bytes, std::size_t size) {
+        data.insert(data.end(), bytes, bytes + size);
+    }
+};
+
+// Decoded content. The statistics are restored exactly, the pulse count
+// is kept separately as PumpDiagnostics only counts pulses it was fed.
+struct Record {
+    uint8_t version = 0;
+    uint8_t flags = 0;
+    uint32_t pulseCount = 0;
+    uint32_t missedSamples = 0;
+    unsigned long baseline = 0;
+    RunningStats intervalStats;
+    RunningStats amplitudeStats;
+    IntervalHistogram intervalHistogram;
+    bool predictedStop = false;
+    bool lastPulseMissed = false;
+    int32_t stopErrorUs = 0;
+    std::vector<unsigned long> pulseTimes;
+    std::vector<float> valuesAtPulses;
+    ShapeTrace fullShape;
+};
+
+// Source: anything with bool read(uint8_t* data, size_t size), false at the end
+template<typename Source>
+class Reader {
+public:
+    explicit Reader(Source& source) : source_(source), ok_(true) {}
+
+    Error read(Record& r) {
+        r = Record();
+        crc_ = Crc32();
+        ok_ = true;
+
+        uint8_t header[8];
+        get(header, sizeof(header));
+        if (!ok_) return Error::Truncated;
+        if (std::memcmp(header, Magic, sizeof(Magic)) != 0) return Error::BadMagic;
+        if (header[4] == 0 || header[4] > Version) return Error::BadVersion;
+        r.version = header[4];
+        r.flags = header[5];
+
+        r.pulseCount = varint();
+        r.missedSamples = varint();
+        r.baseline = varint();
+        stats(r.intervalStats);
+        stats(r.amplitudeStats);
+        r.intervalHistogram.setBinWidth(varint());
+        for (std::size_t i = 0; i < IntervalHistogram::Bins; ++i) {
+            r.intervalHistogram.setCount(i, varint());
+        }
+        uint8_t stop = 0;
+        get(&stop, 1);
+        r.predictedStop = stop & 1;
+        r.lastPulseMissed = stop & 2;
+        r.stopErrorUs = ShapeTrace::unzigzag(varint());
+
+        if (ok_ && (r.flags & History)) {
+            uint32_t n = varint();
+            if (ok_ && n > r.pulseCount) return Error::BadData;
+            // n is not verified until the CRC, so only a bounded amount is
+            // reserved up front; the vectors grow with the data actually read
+            r.pulseTimes.reserve(std::min<uint32_t>(n, MaxReserve));
+            unsigned long last = 0;
+            for (uint32_t i = 0; i < n && ok_; ++i) {
+                last += varint();
+                r.pulseTimes.push_back(last);
+            }
+            r.valuesAtPulses.reserve(std::min<uint32_t>(n, MaxReserve));
+            for (uint32_t i = 0; i < n && ok_; ++i) {
+                r.valuesAtPulses.push_back(real());
+            }
+        }
+        if (ok_ && (r.flags & Shape)) {
+            uint32_t samples = varint();
+            uint32_t pulses = varint();
+            // each entry is one to five bytes; the sizes are not verified
+            // until the CRC either, so the bytes are read in bounded chunks
+            uint32_t sampleSize = varint();
+            if (ok_ && (sampleSize < samples || sampleSize / 5 > samples)) return Error::BadData;
+            std::vector<uint8_t> sampleBytes;
+            bytes(sampleBytes, sampleSize);
+            uint32_t pulseSize = varint();
+            if (ok_ && (pulseSize < pulses || pulseSize / 5 > pulses)) return Error::BadData;
+            std::vector<uint8_t> pulseBytes;
+            bytes(pulseBytes, pulseSize);
+            if (ok_ && !r.fullShape.assignEncoded(std::move(sampleBytes), samples,
+                                                  std::move(pulseBytes), pulses)) {
+                return Error::BadData;
+            }
+        }
+        if (!ok_) return Error::Truncated;
+
+        const uint32_t expected = crc_.value();
+        uint8_t crc[4];
+        if (!source_.read(crc, sizeof(crc))) return Error::Truncated;
+        const uint32_t stored = crc[0] | (crc[1] << 8) | (crc[2] << 16) | (static_cast<uint32_t>(crc[3]) << 24);
+        return stored == expected ? Error::None : Error::BadCrc;
+    }
+
+private:
+    // most elements or bytes allocated before they have been read
+    static constexpr uint32_t MaxReserve = 1024;
+
+    void get(uint8_t* data, std::size_t size) {
+        if (!ok_ || size == 0) return;
+        ok_ = source_.read(data, size);
+        if (ok_) crc_.update(data, size);
+    }
+    // appends size bytes, a truncated record stops after one chunk too many
+    void bytes(std::vector<uint8_t>& out, uint32_t size) {
+        while (ok_ && out.size() < size) {
+            const std::size_t at = out.size();
+            out.resize(at + std::min<std::size_t>(size - at, MaxReserve));
+            get(out.data() + at, out.size() - at);
+        }
+    }
+    uint32_t varint() {
+        uint32_t v = 0;
+        for (unsigned shift = 0; shift < 35 && ok_; shift += 7) {
+            uint8_t b = 0;
+            get(&b, 1);
+            v |= static_cast<uint32_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        ok_ = false; // overlong
+        return 0;
+    }
+    float real() {
+        uint8_t buf[4] = {0, 0, 0, 0};
+        get(buf, sizeof(buf));
+        uint32_t bits = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (static_cast<uint32_t>(buf[3]) << 24);
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+    void stats(RunningStats& s) {
+        uint32_t count = varint();
+        float mean = real();
+        float deviation = real();
+        float lowest = real();
+        float highest = real();
+        s.restore(count, mean, deviation, lowest, highest);
+    }
+
+    Source& source_;
+    Crc32 crc_;
+    bool ok_;
+};
+
+// source reading from a byte buffer
+class BufferSource {
+public:
+    BufferSource(const uint8_t* data, std::size_t size) : data_(data), size_(size), pos_(0) {}
+    bool read(uint8_t* out, std::size_t n) {
+        if (n > size_ - pos_) return false;
+        std::memcpy(out, data_ + pos_, n);
+        pos_ += n;
+        return true;
+    }
+    std::size_t position() const { return pos_; }
+private:
+    const uint8_t* data_;
+    std::size_t size_;
+    std::size_t pos_;
+};
+
+// convenience, decodes one record from a buffer
+inline Error read(const uint8_t* data, std::size_t size, Record& record) {
+    BufferSource source(data, size);
+    return Reader<BufferSource>(source).read(record);
+}
+
+} // namespace diagformat
+
+#endif // DIAGNOSTICS_FORMAT_H
@@ -0,0 +1,229 @@
+#ifndef DOSING_QUEUE_H
+#define DOSING_QUEUE_H
+
+#include "MonitoredPump.h"
+#include "PulseStatistics.h"
+#include "PumpHal.h"
+#include <array>
+#include <initializer_list>
+
+template<std::size_t MaxJobs>
+class DosingQueue {
+    /*
+    * DosingQueue class
+    * Job queue / recipe engine on top of MonitoredPumpBase. A recipe is a
+    * batch of (pump, volume, dependencies) jobs. update() starts every job
+    * whose dependencies are done and whose pump is idle, so independent pumps
+    * run in parallel and a pump starts its next job in the same update()
+    * that sees its previous job finish.
+    *
+    * Jobs on the same pump run in the order they were added. If a job fails,
+    * all jobs depending on it (directly or indirectly) are skipped. A job
+    * whose predictive stop missed the last pulse (RunResult::LastPulseMissed)
+    * ends as Unconfirmed: the pump ran to the end of the dose, so its
+    * dependents still run.
+    *
+    * Parallel operation needs non-blocking pumps (AsyncMonitoredPump);
+    * a plain MonitoredPump runs its job inside update().
+    */
+public:
+    static_assert(MaxJobs > 0 && MaxJobs <= 64, "dependencies are kept in a 64 bit mask");
+
+    using JobId = int;
+
+    enum class JobState : uint8_t {
+        Pending,
+        Running,
+        Done,
+        Failed,
+        Skipped,
+        // ran to the end, but the last pulse was not seen after the cut
+        Unconfirmed
+    };
+
+    // timing and diagnostics of one job
+    struct JobReport {
+        JobState state = JobState::Pending;
+        RunResult result = RunResult::None;
+        unsigned long readyMs = 0;   // dependencies fulfilled
+        unsigned long startMs = 0;
+        unsigned long endMs = 0;
+        uint32_t pulses = 0;
+        RunningStats intervalStats;
+        RunningStats amplitudeStats;
+
+        // time the job waited for its pump after its dependencies were done
+        unsigned long waitMs() const { return startMs - readyMs; }
+        unsigned long runMs() const { return endMs - startMs; }
+    };
+
+    DosingQueue() : count_(0), done_(0), failed_(0) {}
+
+    // Adds a job, returns its id or -1 if the queue is full or a
+    // dependency does not exist (dependencies must be added first).
+    JobId addJob(MonitoredPumpBase& pump, float ml,
+                 std::initializer_list<JobId> dependsOn = {}, bool fullDiagnostics = false) {
+        if (count_ >= MaxJobs) return -1;
+        uint64_t deps = 0;
+        for (JobId dep : dependsOn) {
+            if (dep < 0 || static_cast<std::size_t>(dep) >= count_) return -1;
+            deps |= bit(dep);
+        }
+        Job& job = jobs_[count_];
+        job.pump = &pump;
+        job.ml = ml;
+        job.deps = deps;
+        job.fullDiagnostics = fullDiagnostics;
+        job.ready = false;
+        job.report = JobReport();
+        return static_cast<JobId>(count_++);
+    }
+
+    // Non-blocking: collects finished jobs and starts all jobs that can run.
+    // Call this regularly from the control loop.
+    void update() {
+        // collect first, so freed pumps are restarted in this same update
+        for (std::size_t i = 0; i < count_; ++i) {
+            Job& job = jobs_[i];
+            if (job.report.state == JobState::Running && job.pump->isFinished()) {
+                finish(i);
+            }
+        }
+        for (std::size_t i = 0; i < count_; ++i) {
+            Job& job = jobs_[i];
+            if (job.report.state != JobState::Pending) continue;
+            if (job.deps & failed_) {
+                skip(i);
+                continue;
+            }
+            if ((job.deps & done_) != job.deps) continue;
+            if (!job.ready) {
+                job.ready = true;
+                job.report.readyMs = pumphal::millis();
+            }
+            if (!pumpFree(i)) continue;
+            start(i);
+        }
+    }
+
+    // Runs the whole batch, blocking, polling every pollMs.
+    // Returns true if no job failed or was skipped.
+    bool runAll(uint32_t pollMs = 2) {
+        update();
+        while (!isDone()) {
+            pumphal::delay(pollMs);
+            update();
+        }
+        return failed_ == 0;
+    }
+
+    // true once no job is pending or running
+    bool isDone() const {
+        for (std::size_t i = 0; i < count_; ++i) {
+            JobState state = jobs_[i].report.state;
+            if (state == JobState::Pending || state == JobState::Running) return false;
+        }
+        return true;
+    }
+
+    bool hasFailures() const { return failed_ != 0; }
+
+    // stops all running pumps, pending jobs are skipped
+    void abort() {
+        for (std::size_t i = 0; i < count_; ++i) {
+            Job& job = jobs_[i];
+            if (job.report.state == JobState::Running) {
+                job.pump->stop();
+            } else if (job.report.state == JobState::Pending) {
+                skip(i);
+            }
+        }
+    }
+
+    const JobReport& report(JobId id) const { return jobs_[id].report; }
+    std::size_t size() const { return count_; }
+
+    // removes all jobs, must not be called while jobs are running
+    void clear() {
+        count_ = 0;
+        done_ = 0;
+        failed_ = 0;
+    }
+
+private:
+    struct Job {
+        MonitoredPumpBase* pump = nullptr;
+        float ml = 0;
+        uint64_t deps = 0;
+        bool fullDiagnostics = false;
+        bool ready = false;
+        JobReport report;
+    };
+
+    static uint64_t bit(std::size_t i) { return uint64_t(1) << i; }
+
+    // the pump is idle and no earlier job for it is still pending or running
+    bool pumpFree(std::size_t index) const {
+        const MonitoredPumpBase* pump = jobs_[index].pump;
+        for (std::size_t i = 0; i < index; ++i) {
+            if (jobs_[i].pump != pump) continue;
+            JobState state = jobs_[i].report.state;
+            if (state == JobState::Pending || state == JobState::Running) return false;
+        }
+        return !pump->isBusy();
+    }
+
+    void start(std::size_t i) {
+        Job& job = jobs_[i];
+        job.report.startMs = pumphal::millis();
+        job.report.state = JobState::Running;
+        bool started = job.pump->runForMl(job.ml, job.fullDiagnostics);
+        // async pumps are still busy, synchronous ones are done already
+        if (!job.pump->isBusy()) finish(i, started);
+    }
+
+    void finish(std::size_t i, bool started = true) {
+        Job& job = jobs_[i];
+        JobReport& report = job.report;
+        report.endMs = pumphal::millis();
+        report.result = job.pump->lastResult();
+        if (!started && (report.result == RunResult::Completed || report.result == RunResult::None)) {
+            // async pumps reject a request without touching their last result
+            report.result = RunResult::InvalidRequest;
+        }
+        if (report.result == RunResult::InvalidRequest || report.result == RunResult::DiagnosticsOverflow
+            || report.result == RunResult::StartFailed) {
+            // no run took place, the diagnostics are from an earlier job
+            report.state = JobState::Failed;
+            failed_ |= bit(i);
+            return;
+        }
+        const PumpDiagnostics& diagnostics = job.pump->getDiagnostics();
+        report.pulses = diagnostics.pulseCount();
+        report.intervalStats = diagnostics.intervalStats;
+        report.amplitudeStats = diagnostics.amplitudeStats;
+        if (report.result == RunResult::Completed) {
+            report.state = JobState::Done;
+            done_ |= bit(i);
+        } else if (report.result == RunResult::LastPulseMissed) {
+            report.state = JobState::Unconfirmed;
+            done_ |= bit(i);
+        } else {
+            report.state = JobState::Failed;
+            failed_ |= bit(i);
+        }
+    }
+
+    void skip(std::size_t i) {
+        jobs_[i].report.state = JobState::Skipped;
+        // dependents of a skipped job are skipped as well
+        failed_ |= bit(i);
+    }
+
+    std::array<Job, MaxJobs> jobs_;
+    std::size_t count_;
+    uint64_t done_;
+    uint64_t failed_;
+};
+
+#endif // DOSING_QUEUE_H
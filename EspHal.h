@@ -0,0 +1,282 @@
+#ifndef ESP_HAL_H
+#define ESP_HAL_H
+
+// ESP32 / Arduino backend of the pump HAL, see PumpHal.h
+
+extern "C" {
+    #include "driver/touch_pad.h"
+  }
+#include <Arduino.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include <atomic>
+#include <cstddef>
+#include "esp_timer.h"
+#include "esp_task_wdt.h"
+#include "LoggingBase.h"
+#include "threadSafeArduino.h"
+
+namespace pumphal {
+
+// Serializes the touch access of the pump classes. threadSafeArduino keeps
+// its touch lock to itself, so touchRead takes this one around
+// threadSafe::touchRead and touchReadAll takes it around the register
+// reads: a sweep is never read while a touchRead reconfigures a pad.
+// Other code must reach the touch pads through threadSafe::touchRead only.
+// With waitUs, the time spent waiting for the lock is stored there.
+class TouchLock {
+public:
+    explicit TouchLock(uint32_t* waitUs = nullptr) {
+        const int64_t start = waitUs ? esp_timer_get_time() : 0;
+        xSemaphoreTake(mutex(), portMAX_DELAY);
+        if (waitUs) *waitUs = static_cast<uint32_t>(esp_timer_get_time() - start);
+    }
+    ~TouchLock() { xSemaphoreGive(mutex()); }
+    TouchLock(const TouchLock&) = delete;
+    TouchLock& operator=(const TouchLock&) = delete;
+private:
+    static SemaphoreHandle_t mutex() {
+        static SemaphoreHandle_t m = xSemaphoreCreateMutex();
+        return m;
+    }
+};
+
+// lockWaitUs: time waited for the touch lock of the pump classes. Code
+// outside them that calls threadSafe::touchRead directly contends for the
+// lock inside it, that wait is part of the read time instead.
+inline uint32_t touchRead(uint8_t pin, uint32_t* lockWaitUs = nullptr) {
+    TouchLock lock(lockWaitUs);
+    return threadSafe::touchRead(pin);
+}
+
+inline void configureTouch() {
+    // Set FSM to timer mode (more predictable)
+    touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
+    // Reduce measurement and sleep cycles (faster but noisier)
+    touch_pad_set_meas_time(24, 300);//in 8MHz clock sycles: total of 1.5ms
+}
+
+// Adds the pad of pin to the sweep of the touch FSM, which measures all
+// configured pads one after the other in the background (timer mode).
+// Returns false if pin has no touch channel.
+inline bool addTouchPad(uint8_t pin) {
+    if (digitalPinToTouchChannel(pin) < 0) return false;
+    TouchLock lock;
+    // lets the Arduino core set up the touch peripheral and the pad
+    threadSafe::touchRead(pin);
+    configureTouch();
+    return true;
+}
+
+// Time the FSM takes to measure count pads once: the sleep between sweeps
+// on the RTC slow clock plus one measurement per pad on the 8 MHz clock.
+// Values read sooner than this after the last read may not have changed.
+inline uint32_t touchSweepUs(std::size_t count) {
+    uint16_t sleepCycles = 0;
+    uint16_t measCycles = 0;
+    touch_pad_get_meas_time(&sleepCycles, &measCycles);
+    return static_cast<uint32_t>(sleepCycles * 1000000ULL / 150000
+                                 + count * measCycles / 8);
+}
+
+// Latest measurement of each pad added with addTouchPad. Only fetches the
+// results of the running sweep from the registers, so it does not block
+// like touchRead and costs microseconds no matter how many pads are read.
+// Returns false if a pad could not be read, the values are unusable then.
+inline bool touchReadAll(const uint8_t* pins, std::size_t count, uint32_t* values,
+                         uint32_t* lockWaitUs = nullptr) {
+    TouchLock lock(lockWaitUs);
+    for (std::size_t i = 0; i < count; ++i) {
+        uint16_t value = 0;
+        if (touch_pad_read_raw_data(static_cast<touch_pad_t>(digitalPinToTouchChannel(pins[i])), &value) != ESP_OK) {
+            return false;
+        }
+        values[i] = value;
+    }
+    return true;
+}
+
+inline void pinMode(uint8_t pin, uint8_t mode) {
+    ::pinMode(pin, mode);
+}
+
+inline void digitalWrite(uint8_t pin, uint8_t level) {
+    threadSafe::digitalWrite(pin, level);
+}
+
+inline void IRAM_ATTR rawDigitalWrite(uint8_t pin, uint8_t level) {
+    ::digitalWrite(pin, level);
+}
+
+inline unsigned long IRAM_ATTR micros() {
+    return ::micros();
+}
+
+inline uint64_t IRAM_ATTR micros64() {
+    return esp_timer_get_time();
+}
+
+inline unsigned long millis() {
+    return ::millis();
+}
+
+// calls vTaskDelay under the hood - ok for watchdog
+inline void delay(uint32_t ms) {
+    ::delay(ms);
+}
+
+inline void attachInterrupt(uint8_t pin, void (*handler)(), int mode) {
+    ::attachInterrupt(digitalPinToInterrupt(pin), handler, mode);
+}
+
+class SpinLock {
+public:
+    void lock() { portENTER_CRITICAL(&mux_); }
+    void unlock() { portEXIT_CRITICAL(&mux_); }
+    void IRAM_ATTR lockFromIsr() { portENTER_CRITICAL_ISR(&mux_); }
+    void IRAM_ATTR unlockFromIsr() { portEXIT_CRITICAL_ISR(&mux_); }
+private:
+    portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+};
+
+using TaskHandle = TaskHandle_t;
+
+inline bool createTask(void (*func)(void*), const char* name, uint32_t stackBytes,
+                       void* arg, unsigned priority, TaskHandle* handle, int core) {
+    return xTaskCreatePinnedToCore(func, name, stackBytes, arg, priority, handle, core) == pdPASS;
+}
+
+// does not return
+inline void deleteCurrentTask() {
+    vTaskDelete(NULL);
+}
+
+// Blocks the calling task for good, until another task deletes it with
+// deleteTask(). Lets the owner of a task decide when it is gone.
+inline void parkCurrentTask() {
+    for (;;) vTaskSuspend(NULL);
+}
+
+// forced delete, only if the task did not delete itself already
+inline void deleteTask(TaskHandle h) {
+    if (h && eTaskGetState(h) != eDeleted) {
+        vTaskDelete(h);
+    }
+}
+
+// timeout value of the wait() calls below that never times out
+static constexpr uint32_t WaitForever = UINT32_MAX;
+
+inline TickType_t toTicks(uint32_t timeoutMs) {
+    return timeoutMs == WaitForever ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs);
+}
+
+// Wakes one worker task, as a direct to task notification (no kernel
+// object, faster than a semaphore). Only the task set with setTask() may
+// call wait(); notifications given while it is busy are not lost.
+class TaskNotifier {
+public:
+    void setTask(TaskHandle h) { task_ = h; }
+    void notify() {
+        if (task_) xTaskNotifyGive(task_);
+    }
+    // returns false on timeout
+    bool wait(uint32_t timeoutMs = WaitForever) {
+        return ulTaskNotifyTake(pdTRUE, toTicks(timeoutMs)) > 0;
+    }
+private:
+    TaskHandle task_ = nullptr;
+};
+
+// Flag any number of tasks can wait for, e.g. a finished run. Stays set
+// until clear(), so a wait() after set() returns right away.
+class Event {
+public:
+    Event() : group_(xEventGroupCreate()) {}
+    ~Event() {
+        if (group_) vEventGroupDelete(group_);
+    }
+    Event(const Event&) = delete;
+    Event& operator=(const Event&) = delete;
+
+    void set() { xEventGroupSetBits(group_, Bit); }
+    void clear() { xEventGroupClearBits(group_, Bit); }
+    bool isSet() const { return xEventGroupGetBits(group_) & Bit; }
+    // returns false on timeout
+    bool wait(uint32_t timeoutMs = WaitForever) {
+        return xEventGroupWaitBits(group_, Bit, pdFALSE, pdTRUE, toTicks(timeoutMs)) & Bit;
+    }
+private:
+    static constexpr EventBits_t Bit = 1;
+    EventGroupHandle_t group_;
+};
+
+// Periodic sample clock on an esp_timer. wait() blocks the calling task
+// until the next period starts, so the sample period does not drift with
+// the time spent reading and processing. Ticks that passed while the task
+// was busy are counted as missed.
+class SampleTimer {
+public:
+    SampleTimer() : timer_(nullptr), sem_(nullptr), ticks_(0), seen_(0), missed_(0) {}
+    ~SampleTimer() {
+        stop();
+        if (sem_) vSemaphoreDelete(sem_);
+    }
+
+    bool start(uint32_t periodUs) {
+        stop();
+        if (!sem_) sem_ = xSemaphoreCreateBinary();
+        if (!sem_) return false;
+        xSemaphoreTake(sem_, 0);
+        ticks_.store(0);
+        seen_ = 0;
+        missed_ = 0;
+        esp_timer_create_args_t args = {};
+        args.callback = &SampleTimer::onTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "pump_sample";
+        if (esp_timer_create(&args, &timer_) != ESP_OK) {
+            timer_ = nullptr;
+            return false;
+        }
+        return esp_timer_start_periodic(timer_, periodUs) == ESP_OK;
+    }
+
+    void stop() {
+        if (timer_) {
+            esp_timer_stop(timer_);
+            esp_timer_delete(timer_);
+            timer_ = nullptr;
+        }
+    }
+
+    // blocks until the next tick
+    void wait() {
+        xSemaphoreTake(sem_, portMAX_DELAY);
+        uint32_t t = ticks_.load();
+        if (t - seen_ > 1) missed_ += t - seen_ - 1;
+        seen_ = t;
+    }
+
+    uint32_t missed() const { return missed_; }
+
+private:
+    static void onTimer(void* arg) {
+        SampleTimer* self = static_cast<SampleTimer*>(arg);
+        self->ticks_.fetch_add(1);
+        xSemaphoreGive(self->sem_);
+    }
+
+    esp_timer_handle_t timer_;
+    SemaphoreHandle_t sem_;
+    std::atomic<uint32_t> ticks_;
+    uint32_t seen_;
+    uint32_t missed_;
+};
+
+} // namespace pumphal
+
+#endif // ESP_HAL_H
@@ -1,28 +1,106 @@
-
 // FlowMeter.cpp
 #include "FlowMeter.h"
 
 FlowMeter::FlowMeter(int interruptPin, float pulsesPerLiter, uint32_t debounceTime)
-    : interruptPin(interruptPin), pulsesPerLiter(pulsesPerLiter), 
-    pulseCount(0), lastInterruptTime(0), debounceTime(debounceTime) {}
+    : interruptPin(interruptPin), pulsesPerLiter(pulsesPerLiter),
+    debounceTime(debounceTime), totalPulses(0), lastInterruptTime(0),
+    edgeTimes(), resetOffset(0) {}
 
 void FlowMeter::__begin() {
-    pinMode(interruptPin, INPUT_PULLUP);
-    lastInterruptTime = micros();
+    pumphal::pinMode(interruptPin, INPUT_PULLUP);
+    lastInterruptTime = pumphal::micros64();
 }
 
 void FlowMeter::handleInterrupt() {
-    uint32_t now = micros();
-    if (now - lastInterruptTime > debounceTime) {
-        lastInterruptTime = now;
-        portENTER_CRITICAL_ISR(&mux);
-        pulseCount++;
-        portEXIT_CRITICAL_ISR(&mux);
-    }
+    uint64_t now = pumphal::micros64();
+    if (now - lastInterruptTime <= debounceTime) return;
+    lastInterruptTime = now;
+    // odd sequence: readers retry until the write is complete
+    uint32_t seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    edgeTimes[totalPulses % HistorySize] = now;
+    ++totalPulses;
+    sequence.store(seq + 2, std::memory_order_release);
+}
+
+uint64_t FlowMeter::readTotal() const {
+    uint64_t total;
+    uint32_t before, after;
+    do {
+        before = sequence.load(std::memory_order_acquire);
+        total = totalPulses;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return total;
+}
+
+std::size_t FlowMeter::snapshot(uint64_t* times, std::size_t max, uint64_t& total) const {
+    if (max > HistorySize) max = HistorySize;
+    std::size_t n;
+    uint32_t before, after;
+    do {
+        before = sequence.load(std::memory_order_acquire);
+        total = totalPulses;
+        n = total < max ? static_cast<std::size_t>(total) : max;
+        for (std::size_t i = 0; i < n; ++i) {
+            times[i] = edgeTimes[(total - n + i) % HistorySize];
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return n;
 }
 
 float FlowMeter::getLiters() const {
-    return (float)getPulseCount() / pulsesPerLiter;
+    return (float)getTotalPulses() / pulsesPerLiter;
+}
+
+float FlowMeter::getFlowRate(uint32_t windowMs) const {
+    uint64_t times[HistorySize];
+    uint64_t total;
+    std::size_t n = snapshot(times, HistorySize, total);
+    const uint64_t now = pumphal::micros64();
+    const uint64_t window = static_cast<uint64_t>(windowMs) * 1000;
+    if (n == 0 || window == 0) return 0.0f;
+
+    std::size_t inWindow = 0;
+    while (inWindow < n && now - times[n - 1 - inWindow] < window) ++inWindow;
+    float pulsesPerUs;
+    if (inWindow < n || total <= HistorySize) {
+        // the kept pulses cover the whole window
+        pulsesPerUs = (float)inWindow / window;
+    } else {
+        // more pulses than kept, use the span of the kept ones
+        uint64_t span = times[n - 1] - times[0];
+        if (span == 0) return 0.0f;
+        pulsesPerUs = (float)(n - 1) / span;
+    }
+    return pulsesPerUs * 60e6f / pulsesPerLiter;
+}
+
+float FlowMeter::getInstantFlowRate() const {
+    uint64_t times[2];
+    uint64_t total;
+    if (snapshot(times, 2, total) < 2) return 0.0f;
+    uint64_t interval = times[1] - times[0];
+    // no pulse for longer than the last interval: flow is at most 1/elapsed
+    uint64_t sinceLast = pumphal::micros64() - times[1];
+    if (sinceLast > interval) interval = sinceLast;
+    if (interval == 0) return 0.0f;
+    return 60e6f / interval / pulsesPerLiter;
+}
+
+uint32_t FlowMeter::getIntervalStats(RunningStats& stats, std::size_t maxPulses) const {
+    uint64_t times[HistorySize];
+    uint64_t total;
+    std::size_t n = snapshot(times, maxPulses, total);
+    stats.clear();
+    for (std::size_t i = 1; i < n; ++i) {
+        stats.add(static_cast<float>(times[i] - times[i - 1]));
+    }
+    return stats.count();
 }
 
 int FlowMeter::getInterruptPin() const {
@@ -1,42 +1,89 @@
 // FlowMeter.h
 #pragma once
-#include <Arduino.h>
+#include "PumpHal.h"
+#include "PulseStatistics.h"
+#include <array>
+#include <atomic>
 #include <vector>
-#include "freertos/portmacro.h"
 
 class FlowMeter {
+    /*
+    * The interrupt handler stores the 64 bit timestamp of every accepted
+    * edge in a small ring and counts them in a 64 bit totalizer, so neither
+    * the count nor the debounce comparison wraps on long-running lines.
+    *
+    * The ISR is the only writer and never locks: it publishes through a
+    * sequence counter (odd while writing). Readers copy what they need and
+    * retry if the ISR wrote in between, so all getters are callable from
+    * any task.
+    */
 public:
-    // makximum debounce time about 70 minutes (as this is in microseconds)
+    // number of edge timestamps kept for the rate and interval queries
+    static constexpr std::size_t HistorySize = 64;
+
+    // debounceTime in microseconds
     FlowMeter(int interruptPin, float pulsesPerLiter, uint32_t debounceTime);
 
     void IRAM_ATTR handleInterrupt();
 
     float getLiters() const;
-    
-    inline void reset() { 
-        portENTER_CRITICAL(&mux);
-        pulseCount = 0;
-        portEXIT_CRITICAL(&mux);
+
+    // only moves the reference point, the ISR counter keeps running
+    inline void reset() {
+        uint64_t total = readTotal();
+        mux.lock();
+        resetOffset = total;
+        mux.unlock();
+    }
+
+    // pulses since the last reset
+    uint64_t getTotalPulses() const {
+        uint64_t total = readTotal();
+        mux.lock();
+        uint64_t offset = resetOffset;
+        mux.unlock();
+        return total - offset;
     }
 
     uint32_t getPulseCount() const {
-        portENTER_CRITICAL(&mux);
-        uint32_t count = pulseCount;
-        portEXIT_CRITICAL(&mux);
-        return count;
+        return static_cast<uint32_t>(getTotalPulses());
     }
 
+    // Flow in liters per minute over the last windowMs. If more than
+    // HistorySize pulses fall into the window, the span of the kept pulses
+    // is used instead.
+    float getFlowRate(uint32_t windowMs) const;
+
+    // Flow in liters per minute from the last pulse interval. Decays towards
+    // zero once no pulse arrived for longer than that interval.
+    float getInstantFlowRate() const;
+
+    // Statistics of the intervals (in µs) between the last maxPulses pulses,
+    // at most HistorySize. Returns the number of intervals.
+    uint32_t getIntervalStats(RunningStats& stats, std::size_t maxPulses = HistorySize) const;
+
     int getInterruptPin() const;
     void __begin();
 
 private:
+    // copies the newest (up to max) edge times, oldest first,
+    // returns how many were copied
+    std::size_t snapshot(uint64_t* times, std::size_t max, uint64_t& total) const;
+    uint64_t readTotal() const;
+
     int interruptPin;
-    volatile uint32_t pulseCount;
-    uint32_t lastInterruptTime;
     float pulsesPerLiter;
-
     uint32_t debounceTime; // in microseconds
-    mutable portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    // written by the ISR only
+    std::atomic<uint32_t> sequence{0};
+    uint64_t totalPulses;
+    uint64_t lastInterruptTime;
+    std::array<uint64_t, HistorySize> edgeTimes;
+
+    // task side
+    uint64_t resetOffset;
+    mutable pumphal::SpinLock mux;
 };
 
 #define CREATE_FLOWMETER(name, interruptPin, pulsesPerLiter, debouncetime) \
@@ -47,5 +94,5 @@ private:
 
 #define BEGIN_FLOWMETER(name) \
     name.__begin(); \
-    attachInterrupt(digitalPinToInterrupt(name.getInterruptPin()), name##_interruptHandler, FALLING)
+    pumphal::attachInterrupt(name.getInterruptPin(), name##_interruptHandler, FALLING)
 
@@ -0,0 +1,245 @@
+#ifndef ARDUINO
+
+#include "HostHal.h"
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+String::String(double v, unsigned int decimals) {
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%.*f", static_cast<int>(decimals), v);
+    assign(buf);
+}
+
+namespace pumphal {
+
+namespace {
+
+constexpr std::size_t kMaxPins = 64;
+
+struct HostState {
+    std::recursive_mutex lock;
+    std::atomic<uint64_t> now{0};
+    std::vector<host::Device*> devices;
+    uint8_t levels[kMaxPins] = {};
+    void (*handlers[kMaxPins])() = {};
+    uint32_t touchReadTimeUs = 0;
+    uint32_t touchSweepUsPerPad = 0;
+    uint32_t touchReadAllFailures = 0;
+    uint64_t touchReads = 0;
+    uintptr_t nextTask = 0;
+};
+
+HostState& state() {
+    static HostState s;
+    return s;
+}
+
+void advanceDevicesTo(HostState& s, uint64_t t) {
+    s.now.store(t, std::memory_order_relaxed);
+    for (host::Device* d : s.devices) d->advanceTo(t);
+}
+
+} // namespace
+
+namespace host {
+
+void registerDevice(Device* device) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    device->advanceTo(s.now.load());
+    s.devices.push_back(device);
+}
+
+void unregisterDevice(Device* device) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    s.devices.erase(std::remove(s.devices.begin(), s.devices.end(), device), s.devices.end());
+}
+
+uint64_t nowUs() {
+    return state().now.load(std::memory_order_relaxed);
+}
+
+void advanceTime(uint64_t us) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    const uint64_t target = s.now.load() + us;
+    while (true) {
+        // earliest edge in the interval, delivered in time order
+        Device* next = nullptr;
+        uint64_t edge = UINT64_MAX;
+        for (Device* d : s.devices) {
+            uint64_t e = d->nextEdgeUs();
+            if (e <= target && e < edge) {
+                edge = e;
+                next = d;
+            }
+        }
+        if (!next) break;
+        int pin = next->edgePin();
+        advanceDevicesTo(s, edge);
+        if (pin >= 0) triggerInterrupt(static_cast<uint8_t>(pin));
+    }
+    advanceDevicesTo(s, target);
+}
+
+void reset() {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    s.now.store(0);
+    std::fill(std::begin(s.levels), std::end(s.levels), 0);
+    std::fill(std::begin(s.handlers), std::end(s.handlers), nullptr);
+    s.touchReadTimeUs = 0;
+    s.touchSweepUsPerPad = 0;
+    s.touchReadAllFailures = 0;
+    s.touchReads = 0;
+    for (Device* d : s.devices) d->advanceTo(0);
+}
+
+void setTouchReadTimeUs(uint32_t us) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    s.touchReadTimeUs = us;
+}
+
+void setTouchSweepUs(uint32_t usPerPad) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    s.touchSweepUsPerPad = usPerPad;
+}
+
+void failTouchReadAll(uint32_t count) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    s.touchReadAllFailures = count;
+}
+
+uint8_t pinLevel(uint8_t pin) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    return pin < kMaxPins ? s.levels[pin] : 0;
+}
+
+void triggerInterrupt(uint8_t pin) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    if (pin < kMaxPins && s.handlers[pin]) s.handlers[pin]();
+}
+
+uint64_t touchReadCount() {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    return s.touchReads;
+}
+
+} // namespace host
+
+uint32_t touchRead(uint8_t pin, uint32_t* lockWaitUs) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    if (lockWaitUs) *lockWaitUs = 0;
+    ++s.touchReads;
+    uint32_t value = 0;
+    for (host::Device* d : s.devices) {
+        if (d->touchRead(pin, s.now.load(), value)) break;
+    }
+    // the value is captured at the start of the read
+    if (s.touchReadTimeUs) host::advanceTime(s.touchReadTimeUs);
+    return value;
+}
+
+bool touchReadAll(const uint8_t* pins, std::size_t count, uint32_t* values, uint32_t* lockWaitUs) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    if (lockWaitUs) *lockWaitUs = 0;
+    if (s.touchReadAllFailures > 0) {
+        --s.touchReadAllFailures;
+        return false;
+    }
+    s.touchReads += count;
+    for (std::size_t i = 0; i < count; ++i) {
+        values[i] = 0;
+        for (host::Device* d : s.devices) {
+            if (d->touchRead(pins[i], s.now.load(), values[i])) break;
+        }
+    }
+    if (s.touchReadTimeUs) host::advanceTime(s.touchReadTimeUs);
+    return true;
+}
+
+uint32_t touchSweepUs(std::size_t count) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    return static_cast<uint32_t>(count * s.touchSweepUsPerPad);
+}
+
+void pinMode(uint8_t /*pin*/, uint8_t /*mode*/) {
+    // nothing to configure on the host
+}
+
+void digitalWrite(uint8_t pin, uint8_t level) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    if (pin < kMaxPins) s.levels[pin] = level;
+    for (host::Device* d : s.devices) {
+        d->advanceTo(s.now.load());
+        d->onPinWrite(pin, level);
+    }
+}
+
+void delay(uint32_t ms) {
+    host::advanceTime(static_cast<uint64_t>(ms) * 1000);
+    std::this_thread::yield();
+}
+
+void SampleTimer::wait() {
+    uint64_t now = host::nowUs();
+    if (now < next_) {
+        host::advanceTime(next_ - now);
+    } else {
+        // late: run now, skip the periods that already passed
+        uint64_t late = (now - next_) / period_;
+        missed_ += static_cast<uint32_t>(late);
+        next_ += late * period_;
+    }
+    next_ += period_;
+    std::this_thread::yield();
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(), int /*mode*/) {
+    HostState& s = state();
+    std::lock_guard<std::recursive_mutex> g(s.lock);
+    if (pin < kMaxPins) s.handlers[pin] = handler;
+}
+
+bool createTask(void (*func)(void*), const char* /*name*/, uint32_t /*stackBytes*/,
+                void* arg, unsigned /*priority*/, TaskHandle* handle, int /*core*/) {
+    HostState& s = state();
+    {
+        std::lock_guard<std::recursive_mutex> g(s.lock);
+        // publish the handle before the task can run and clear it again
+        if (handle) *handle = reinterpret_cast<TaskHandle>(++s.nextTask);
+    }
+    try {
+        std::thread(func, arg).detach();
+    } catch (const std::system_error&) {
+        if (handle) *handle = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void deleteCurrentTask() {
+    // returning from the task function ends the thread
+}
+
+void deleteTask(TaskHandle /*h*/) {
+    // host threads cannot be killed
+}
+
+} // namespace pumphal
+
+#endif // ARDUINO
@@ -0,0 +1,260 @@
+#ifndef HOST_HAL_H
+#define HOST_HAL_H
+
+/*
+* Linux backend of the pump HAL, see PumpHal.h
+*
+* Time is virtual: micros()/millis() read a global clock that only moves
+* when delay() or host::advanceTime() is called (and optionally by a fixed
+* cost per touchRead), so runs are deterministic and as fast as the CPU allows.
+* There is one clock for all tasks: if several tasks delay at the same
+* time, each moves it, and time runs faster than each of them expects. Let
+* one task move the clock, e.g. wait for an AsyncMonitoredPump with
+* waitFinished() rather than polling it with delay().
+*
+* Hardware is provided by host::Device instances (e.g. SimulatedPump) that
+* register themselves. They see GPIO writes, answer touch reads and can
+* raise interrupt edges, which are delivered to the handlers installed via
+* attachInterrupt() at the exact virtual time of the edge.
+*/
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Arduino compatible constants, so the library code stays unchanged
+#ifndef LOW
+#define LOW 0x0
+#endif
+#ifndef HIGH
+#define HIGH 0x1
+#endif
+#ifndef INPUT
+#define INPUT 0x01
+#endif
+#ifndef OUTPUT
+#define OUTPUT 0x03
+#endif
+#ifndef INPUT_PULLUP
+#define INPUT_PULLUP 0x05
+#endif
+#ifndef RISING
+#define RISING 0x01
+#endif
+#ifndef FALLING
+#define FALLING 0x02
+#endif
+#ifndef CHANGE
+#define CHANGE 0x03
+#endif
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+// Minimal stand-in for the Arduino String, enough for the summaries
+class String : public std::string {
+public:
+    String() = default;
+    String(const char* s) : std::string(s) {}
+    String(const std::string& s) : std::string(s) {}
+    String(int v) : std::string(std::to_string(v)) {}
+    String(unsigned int v) : std::string(std::to_string(v)) {}
+    String(long v) : std::string(std::to_string(v)) {}
+    String(unsigned long v) : std::string(std::to_string(v)) {}
+    String(long long v) : std::string(std::to_string(v)) {}
+    String(unsigned long long v) : std::string(std::to_string(v)) {}
+    String(float v, unsigned int decimals = 2) : String(static_cast<double>(v), decimals) {}
+    String(double v, unsigned int decimals = 2);
+};
+
+namespace pumphal {
+
+namespace host {
+
+// Simulated hardware attached to the host backend.
+// All callbacks run with the backend lock held.
+class Device {
+public:
+    virtual ~Device() = default;
+    // accrue internal state up to the given virtual time
+    virtual void advanceTo(uint64_t nowUs) = 0;
+    // a GPIO was written (after advanceTo(now))
+    virtual void onPinWrite(uint8_t /*pin*/, uint8_t /*level*/) {}
+    // answer a touch read on pin, return false if the pin is not ours
+    virtual bool touchRead(uint8_t /*pin*/, uint64_t /*nowUs*/, uint32_t& /*value*/) { return false; }
+    // virtual time of the next interrupt edge, strictly after the last advanceTo()
+    virtual uint64_t nextEdgeUs() const { return UINT64_MAX; }
+    // pin on which nextEdgeUs() fires
+    virtual int edgePin() const { return -1; }
+};
+
+void registerDevice(Device* device);
+void unregisterDevice(Device* device);
+
+// virtual clock
+uint64_t nowUs();
+// moves the clock forward, delivering all device edges on the way
+void advanceTime(uint64_t us);
+// resets clock, pin levels, interrupt handlers and the touch read settings
+void reset();
+
+// virtual time consumed by each touchRead (after capturing the value), default 0
+void setTouchReadTimeUs(uint32_t us);
+// time the simulated touch FSM takes per pad for one sweep, default 0
+// (every touchReadAll sees new values)
+void setTouchSweepUs(uint32_t usPerPad);
+// the next count calls of touchReadAll fail, like a read error of a pad
+void failTouchReadAll(uint32_t count);
+
+// current level of an output pin
+uint8_t pinLevel(uint8_t pin);
+
+// calls the handler installed with attachInterrupt for this pin (if any)
+void triggerInterrupt(uint8_t pin);
+
+// number of touch reads served since reset()
+uint64_t touchReadCount();
+
+} // namespace host
+
+// lockWaitUs is always 0: the virtual clock does not move while a task
+// waits for the backend lock
+uint32_t touchRead(uint8_t pin, uint32_t* lockWaitUs = nullptr);
+inline void configureTouch() {}
+inline bool addTouchPad(uint8_t /*pin*/) { return true; }
+// see host::setTouchSweepUs
+uint32_t touchSweepUs(std::size_t count);
+// all values are captured at the same time, the sweep costs one touch read
+// time; fails (returns false) only when set up with host::failTouchReadAll
+bool touchReadAll(const uint8_t* pins, std::size_t count, uint32_t* values,
+                  uint32_t* lockWaitUs = nullptr);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+inline void rawDigitalWrite(uint8_t pin, uint8_t level) {
+    digitalWrite(pin, level);
+}
+
+inline uint64_t micros64() {
+    return host::nowUs();
+}
+// 32 bit like on the ESP32, so wrap-around paths get exercised
+inline unsigned long micros() {
+    return static_cast<uint32_t>(host::nowUs());
+}
+inline unsigned long millis() {
+    return static_cast<uint32_t>(host::nowUs() / 1000);
+}
+// advances the virtual clock and yields to other host tasks
+void delay(uint32_t ms);
+
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode);
+
+class SpinLock {
+public:
+    void lock() {
+        while (flag_.test_and_set(std::memory_order_acquire)) {}
+    }
+    void unlock() { flag_.clear(std::memory_order_release); }
+    void lockFromIsr() { lock(); }
+    void unlockFromIsr() { unlock(); }
+private:
+    std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+};
+
+// Periodic sample clock on the virtual clock: wait() advances time to the
+// next period, or counts the missed periods if the caller is already late.
+class SampleTimer {
+public:
+    bool start(uint32_t periodUs) {
+        period_ = periodUs > 0 ? periodUs : 1;
+        next_ = host::nowUs() + period_;
+        missed_ = 0;
+        return true;
+    }
+    void stop() {}
+    void wait();
+    uint32_t missed() const { return missed_; }
+private:
+    uint64_t period_ = 1;
+    uint64_t next_ = 0;
+    uint32_t missed_ = 0;
+};
+
+// Tasks are detached std::threads. A host task cannot be killed, so
+// deleteTask() only forgets the handle, and deleteCurrentTask() and
+// parkCurrentTask() return; they must be the last statement of the task
+// function.
+using TaskHandle = void*;
+
+bool createTask(void (*func)(void*), const char* name, uint32_t stackBytes,
+                void* arg, unsigned priority, TaskHandle* handle, int core);
+void deleteCurrentTask();
+inline void parkCurrentTask() {}
+void deleteTask(TaskHandle h);
+
+// Timeouts of the wait() calls below run in real time, not on the virtual
+// clock: the clock only moves when a task delays, which a waiting task does not.
+static constexpr uint32_t WaitForever = UINT32_MAX;
+
+// wakes one worker task, see EspHal.h
+class TaskNotifier {
+public:
+    void setTask(TaskHandle) {}
+    void notify() {
+        std::lock_guard<std::mutex> g(lock_);
+        pending_ = true;
+        cv_.notify_one();
+    }
+    bool wait(uint32_t timeoutMs = WaitForever) {
+        std::unique_lock<std::mutex> g(lock_);
+        if (timeoutMs == WaitForever) {
+            cv_.wait(g, [this] { return pending_; });
+        } else if (!cv_.wait_for(g, std::chrono::milliseconds(timeoutMs), [this] { return pending_; })) {
+            return false;
+        }
+        pending_ = false;
+        return true;
+    }
+private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    bool pending_ = false;
+};
+
+// flag any number of tasks can wait for, see EspHal.h
+class Event {
+public:
+    void set() {
+        std::lock_guard<std::mutex> g(lock_);
+        set_ = true;
+        cv_.notify_all();
+    }
+    void clear() {
+        std::lock_guard<std::mutex> g(lock_);
+        set_ = false;
+    }
+    bool isSet() const {
+        std::lock_guard<std::mutex> g(lock_);
+        return set_;
+    }
+    bool wait(uint32_t timeoutMs = WaitForever) {
+        std::unique_lock<std::mutex> g(lock_);
+        if (timeoutMs == WaitForever) {
+            cv_.wait(g, [this] { return set_; });
+            return true;
+        }
+        return cv_.wait_for(g, std::chrono::milliseconds(timeoutMs), [this] { return set_; });
+    }
+private:
+    mutable std::mutex lock_;
+    std::condition_variable cv_;
+    bool set_ = false;
+};
+
+} // namespace pumphal
+
+#endif // HOST_HAL_H
@@ -1,48 +1,50 @@
 #include "MonitoredPump.h"
+#include <math.h>
 
 
-float PumpDiagnostics::averagePulseTime() const{
-    if(pulseTimes.size() < 2){
-        return 0.0;
-    }
-    float sum = 0.0;
-    for(size_t i=1; i<pulseTimes.size(); ++i){
-        sum += pulseTimes[i] - pulseTimes[i-1];
-    }
-    return sum / (pulseTimes.size() - 1);
+void PumpDiagnostics::addPulse(unsigned long timeUs, float value){
+    if(keepHistory_){
+        if(fixed_ && pulseTimes.size() >= pulseTimes.capacity()){
+            overflowed = true;
+        }else{
+            pulseTimes.push_back(timeUs);
+            valuesAtPulses.push_back(value);
+        }
+    }
+    updateStatistics(timeUs, value);
 }
-float PumpDiagnostics::timeDeviation() const{
-    if(pulseTimes.size() < 2){
-        return 0.0;
-    }
-    float sum = 0.0;
-    float avg = averagePulseTime();
-    for(size_t i=1; i<pulseTimes.size(); ++i){
-        sum += sq(pulseTimes[i] - pulseTimes[i-1] - avg);
-    }
-    return sqrt(sum / (pulseTimes.size() - 1));
+
+void PumpDiagnostics::reserveFixed(std::size_t maxPulses, std::size_t maxSamples){
+    pulseTimes.reserve(maxPulses + 1);
+    valuesAtPulses.reserve(maxPulses + 1);
+    //two marker bytes per pulse covers pulses up to 2^14 samples apart
+    fullShape.reserve(maxSamples, maxSamples > 0 ? 2 * (maxPulses + 1) : 0);
+    fullShape.setFixedCapacity(true);
+    fixed_ = true;
 }
-float PumpDiagnostics::averageAmplitude() const{
-    // we have pulses at minima and maxima, so the amplitude is the difference between the two
-    if(valuesAtPulses.size() < 2){
-        return 0.0;
-    }
-    float sum = 0.0;
-    for(size_t i=1; i<valuesAtPulses.size(); ++i){
-        sum += abs(valuesAtPulses[i] - valuesAtPulses[i-1]);
-    }
-    return sum / ((valuesAtPulses.size() - 1));//each counts twice
+
+void PumpDiagnostics::updateStatistics(unsigned long timeUs, float value){
+    if(pulses_ > 0){
+        // 32 bit difference, correct across micros() wrap-around
+        uint32_t interval = static_cast<uint32_t>(timeUs - lastTime_);
+        intervalStats.add(interval);
+        intervalHistogram.add(interval);
+        // we have pulses at minima and maxima, so the amplitude is the difference between the two
+        amplitudeStats.add(fabs(value - lastValue_));
+    }
+    lastTime_ = timeUs;
+    lastValue_ = value;
+    ++pulses_;
 }
-float PumpDiagnostics::amplitudeDeviation() const{
-    
-    if(valuesAtPulses.size() < 1){
-        return 0.0;
-    }
-    float sum = 0.0;
-    float avg = averageAmplitude(); //this is 1/2 peak to peak
-    for(size_t i=1; i<valuesAtPulses.size(); ++i){
-        sum += sq(abs(valuesAtPulses[i] - valuesAtPulses[i-1]) - avg);
+
+void PumpDiagnostics::recomputeStatistics(){
+    intervalStats.clear();
+    amplitudeStats.clear();
+    uint32_t binWidth = intervalHistogram.binWidth();
+    intervalHistogram.clear();
+    intervalHistogram.setBinWidth(binWidth);
+    pulses_ = 0;
+    for(size_t i=0; i<pulseTimes.size() && i<valuesAtPulses.size(); ++i){
+        updateStatistics(pulseTimes[i], valuesAtPulses[i]);
     }
-    return sqrt(sum / ((valuesAtPulses.size() - 1)));
 }
-
@@ -1,35 +1,72 @@
 
 #ifndef MONITORED_PUMP_H
 #define MONITORED_PUMP_H
-extern "C" {
-    #include "driver/touch_pad.h"
-  }
-#include <Arduino.h>
+#include "PumpHal.h"
 #include <vector>
-#include <PulseLookaheadDetector.h>
-#include "esp_task_wdt.h"
-#include "LoggingBase.h"
+#include <PulseExtremaDetector.h>
+#include "PulseStatistics.h"
+#include "ShapeTrace.h"
+#include "PumpTelemetry.h"
+#include "PumpEvents.h"
+#include "PumpHealth.h"
+#include "AdaptivePulseDetector.h"
+#include "CalibrationStore.h"
+#include "PumpInstrumentation.h"
+#include "SignalFilters.h"
 #include <atomic>
-#include "threadSafeArduino.h"
+#include <array>
 
 
 
 // little helper class for diagnostic information
+// By default only streaming statistics are kept (constant memory, updated
+// with every pulse). The full pulse history (pulseTimes, valuesAtPulses) is
+// only recorded if enabled with setKeepHistory(true).
 class PumpDiagnostics {
 public:
-    // convencience method to check if there are any pulses
-    // the other vectors are always filled if there are pulses
+    // convencience method to check if the full shape was recorded
     bool hasFullShape(){return fullShape.size() > 0;}
-    float averagePulseTime() const;
-    float timeDeviation() const;
-    float averageAmplitude() const;
-    float amplitudeDeviation() const;
+    float averagePulseTime() const { return intervalStats.mean(); }
+    float timeDeviation() const { return intervalStats.deviation(); }
+    float averageAmplitude() const { return amplitudeStats.mean(); }
+    float amplitudeDeviation() const { return amplitudeStats.deviation(); }
+    uint32_t pulseCount() const { return pulses_; }
+
+    // records a detected pulse, updates the statistics in O(1)
+    void addPulse(unsigned long timeUs, float value);
+
+    // rebuilds the statistics from pulseTimes and valuesAtPulses,
+    // e.g. after filling those from a recording
+    void recomputeStatistics();
+
+    void setKeepHistory(bool keep) { keepHistory_ = keep; }
+    bool keepsHistory() const { return keepHistory_; }
+
+    // Allocates the history and the full shape once for up to maxPulses
+    // pulses and maxSamples samples. From then on the buffers never grow or
+    // shrink: clear() keeps the memory, and a run that records more sets
+    // overflowed and drops the rest of its history (the statistics stay
+    // complete). No heap use per run, and no fragmentation from many runs.
+    void reserveFixed(std::size_t maxPulses, std::size_t maxSamples);
+    bool fixedCapacity() const { return fixed_; }
+    std::size_t historyCapacity() const { return pulseTimes.capacity(); }
 
     void clear() {
         pulseTimes.clear();
-        isPulse.clear();
         valuesAtPulses.clear();
         fullShape.clear();
+        intervalStats.clear();
+        amplitudeStats.clear();
+        intervalHistogram.clear();
+        missedSamples = 0;
+        predictedStop = false;
+        lastPulseMissed = false;
+        stopErrorUs = 0;
+        overflowed = false;
+        pulses_ = 0;
+#if defined(PUMP_INSTRUMENTATION)
+        instrumentation.clear();
+#endif
         //baseline = 0; //don't clear baseline
     }
 
@@ -38,13 +75,86 @@ public:
         + String(averageAmplitude()) + " +- " + String(amplitudeDeviation()) + "; Baseline: " + String(baseline);
     }
 
+    // streaming statistics, always available
+    RunningStats intervalStats;   // time between consecutive pulses in µs
+    RunningStats amplitudeStats;  // difference between consecutive pulse values
+    IntervalHistogram intervalHistogram;
+    // sample periods skipped because the loop was late (timer sampling only)
+    uint32_t missedSamples = 0;
+    // predictive stop (MonitoredPump::setPredictiveStop): true if the power
+    // was cut at the predicted last pulse. stopErrorUs is the time of the
+    // last pulse relative to the cut, negative if the cut came too late.
+    // If the last pulse was not seen after the cut, lastPulseMissed is set
+    // and stopErrorUs is the time sampled after the cut.
+    bool predictedStop = false;
+    bool lastPulseMissed = false;
+    int32_t stopErrorUs = 0;
+    // fixed capacity only: the history or the full shape of the run was
+    // cut short because the reserved buffers were full
+    bool overflowed = false;
+
+    // full history, only filled if keepsHistory(): the interpolated pulse
+    // times and values, see PulseExtremaDetector
     std::vector<unsigned long> pulseTimes;
-    std::vector<bool> isPulse;
-    std::vector<int32_t> valuesAtPulses;
-    std::vector<int32_t> fullShape;
+    // float since the values are interpolated between samples (it held the
+    // raw int32_t samples before), round if whole touch values are needed
+    std::vector<float> valuesAtPulses;
+    // full shape (samples minus baseline) with pulse markers,
+    // only filled with fulldiagnostics
+    ShapeTrace fullShape;
     unsigned long baseline=0;
+#if defined(PUMP_INSTRUMENTATION)
+    // sampling loop timing and detector counts, see PumpInstrumentation.h
+    SamplingInstrumentation instrumentation;
+#endif
+
+private:
+    void updateStatistics(unsigned long timeUs, float value);
+
+    bool keepHistory_ = false;
+    bool fixed_ = false;
+    uint32_t pulses_ = 0;
+    unsigned long lastTime_ = 0;
+    float lastValue_ = 0;
 };
 
+// how runForPulses paces its samples
+enum class SamplingMode : uint8_t {
+    Delay,  // delay() after each sample, period drifts with read time and load
+    Timer   // periodic timer, fixed sample period regardless of read time
+};
+
+// outcome of the last run of a pump
+enum class RunResult : uint8_t {
+    None = 0,        // no run finished yet
+    Completed,       // all requested pulses detected
+    Aborted,         // stopped early on request
+    InvalidRequest,  // zero pulses, or volume too small for the pump
+    // stopped early by the online fault detection, see PumpHealth.h
+    DryRun,
+    Clog,
+    HoseBreak,
+    Stalled,
+    // not started, the pulses or samples would not fit into the buffers
+    // of MonitoredPump::reserveDiagnostics
+    DiagnosticsOverflow,
+    // not started, the worker task of an AsyncMonitoredPump could not be created
+    StartFailed,
+    // predictive stop cut the power and the last pulse was not detected
+    // afterwards: it may have happened right at the cut, or not at all
+    LastPulseMissed
+};
+
+inline RunResult toRunResult(PumpFault fault) {
+    switch(fault){
+        case PumpFault::DryRun: return RunResult::DryRun;
+        case PumpFault::Clog: return RunResult::Clog;
+        case PumpFault::HoseBreak: return RunResult::HoseBreak;
+        case PumpFault::Stalled: return RunResult::Stalled;
+        default: return RunResult::None;
+    }
+}
+
 class MonitoredPumpBase {
     // virtual base class for MonitoredPump
 public:
@@ -59,9 +169,52 @@ public:
     virtual float pulsesPerMl() const = 0;
     virtual bool volumeSupported(float ml) const = 0;
     virtual uint32_t getApproxSamplesPerPulse() const = 0;
+    virtual RunResult lastResult() const = 0;
+
+    // Run state machine behind runForPulses. Lets a scheduler drive
+    // several pumps from one sampling task: beginRun() once, then one
+    // processSample() per sample period until it returns true, then endRun().
+    // samplePeriodUs is the time between two processSample() calls of the
+    // caller; the histogram, the predictive stop and the instrumentation
+    // are scaled by it. Do not mix with runForPulses/runForMl on the same pump.
+    virtual bool beginRun(uint32_t pulses, bool fulldiagnostics, uint32_t samplePeriodUs) = 0;
+    virtual uint8_t touchPin() const = 0;
+    // raw touch value and the time it was read, true once all pulses are
+    // detected, a fault was found or the last pulse was missed after a
+    // predictive stop; endRun(Completed) then records the fault or the miss
+    virtual bool processSample(uint32_t raw_value, unsigned long timeUs) = 0;
+    virtual void endRun(RunResult result) = 0;
+    // touch value read while the pump is off, for the baseline tracking
+    virtual void addIdleSample(uint32_t raw_value) = 0;
+#if defined(PUMP_INSTRUMENTATION)
+    // counters of the current run, for loops driving processSample
+    virtual SamplingInstrumentation& instrumentation() = 0;
+#endif
+
+    // Events, see PumpEvents.h. onPulse, onProgress and onTelemetry are fed
+    // from the telemetry channel, which must be attached for them, and
+    // dispatchEvents() is then its only consumer. onComplete comes from the
+    // completion and needs no channel. Set both while the pump is idle.
+    virtual void attachTelemetry(TelemetryChannel* channel) = 0;
+    virtual void setCallbacks(const PumpCallbacks& callbacks) = 0;
+    // runs the callbacks of all queued events in the calling task,
+    // returns the number of events handled
+    virtual std::size_t dispatchEvents() = 0;
+
+    // the last run request, set when it has ended or was refused
+    PumpCompletion& completion() { return completion_; }
+    const PumpCompletion& completion() const { return completion_; }
+
+protected:
+    PumpCompletion completion_;
 };
 
-template<std::size_t  Lookahead>
+// Lookahead is the detector window (the maximum one for an adaptive detector),
+// Filter conditions the touch values before detection (SignalFilters.h).
+// A run only detects pulses from its lookahead-th sample on, and the pump
+// stops lookahead samples after the last pulse, so back to back runs need
+// at least 2*lookahead+1 samples per pulse not to miss the first pulse.
+template<std::size_t  Lookahead, typename Detector = PulseExtremaDetector<int32_t,Lookahead>, typename Filter = NoFilter>
 class MonitoredPump : public MonitoredPumpBase {
     /*
     * MonitoredPump class
@@ -70,9 +223,9 @@ class MonitoredPump : public MonitoredPumpBase {
     * It needs an enable pin and a touch pin, as well as a lookahead window size, as 
     * well as the pulses per ml of pumped fluid.
     * 
-    * There will be two pulse detectors, one operating on the peaks of the signal
-    * and the other operating on the troughs of the signal. The difference between
-    * the two detectors will be used to calculate the amplitude, which can be used
+    * A fused pulse detector finds both the peaks and the troughs of the signal
+    * in a single pass. The difference between consecutive peak and trough
+    * values will be used to calculate the amplitude, which can be used
     * subsequently to check if the pump is transferring fluid or air (emty tank).
     * 
     * The flow rate will be calculated by counting the number of pulses in a given
@@ -85,6 +238,10 @@ class MonitoredPump : public MonitoredPumpBase {
     * 
     * The latter might happen if the hose in the pump is broken and provides less
     * resistance to the pump, or if the pump is clogged and provides more resistance.
+    *
+    * With setFaultDetection(true) these checks run online while pumping
+    * (PumpHealthMonitor) against a profile learned from completed runs, and
+    * a run is stopped as soon as a fault shows up (RunResult::DryRun etc.).
     */
 private:
     const uint8_t enablePin_;
@@ -92,32 +249,114 @@ private:
     const float pulsesPerMl_;
     
     mutable uint32_t approxSamplesPerPulse_;
-    uint32_t capBaseline_=0;
+    // touch value of the idle signal, tracked while running and from idle reads
+    BaselineTracker baseline_;
+    float pulsesPerMlCorrection_=1;
+
+    // persistent calibration, optional
+    CalibrationStore* calibrationStore_=nullptr;
+    const char* calibrationKey_=nullptr;
+    bool autoSaveCalibration_=false;
+    // what the store holds, autoSave only writes when it is out of date
+    mutable PumpCalibration savedCalibration_;
+    bool calibrationDrifted() const;
+    bool keepPulseHistory_=false;
+    bool idleReadAtStart_=true;
+
+    // state of the current run
+    uint32_t remainingPulses_=0;
+    unsigned long totalSamples_=0;
+    uint32_t samplePeriodUs_=SampleIntervalMs * 1000;   // of the current or last run
+    bool fulldiagnostics_=false;
+    RunResult lastResult_=RunResult::None;
+    SamplingMode samplingMode_=SamplingMode::Delay;
+
+    // predictive stop, stopOffsetUs_ is learned from run to run
+    bool predictiveStop_=false;
+    int32_t stopOffsetUs_=0;
+    bool stopPending_=false;
+    bool powerCut_=false;
+    unsigned long predictedStopUs_=0;
+    unsigned long lastPulseTimeUs_=0;
+    uint32_t stopPeriodUs_=0;
+    uint32_t graceSamples_=0;
+
+    // online fault detection, the profile is learned from completed runs
+    bool faultDetection_=false;
+    PumpProfile profile_;
+    HealthLimits healthLimits_;
+    PumpHealthMonitor health_;
+    RunResult fault_=RunResult::None;
+
+    // encoded size of the full shape of the last run, for shapeFits
+    float shapeBytesPerSample_=0;
+    bool shapeFits(uint32_t pulses) const;
+
+    void predictStop(unsigned long pulseTime);
+    void recordStop(int32_t errorUs, bool missed);
 
-    PulseLookaheadDetector<int32_t,Lookahead> peakDetector;
-    PulseLookaheadDetector<int32_t,Lookahead> troughDetector;
+    // capture times of the newest samples, back to the one before the
+    // center sample (the detector may use less than Lookahead)
+    std::array<unsigned long, Lookahead+2> sampleTimes_;
+    std::size_t sampleTimePos_=0;
+
+    // live telemetry, optional
+    TelemetryChannel* telemetry_=nullptr;
+    PumpCallbacks callbacks_;
+    uint32_t dispatchedSequence_=0;   // last completion passed to onComplete
+    uint32_t requestedPulses_=0;
+    uint16_t sampleCountdown_=0;
+    uint16_t progressCountdown_=0;
+
+    void publish(TelemetryEvent::Type type, uint8_t detail, unsigned long timeUs,
+                 int32_t value, uint32_t count) {
+        TelemetryEvent event;
+        event.type = type;
+        event.detail = detail;
+        event.reserved = 0;
+        event.timeUs = timeUs;
+        event.value = value;
+        event.count = count;
+        //completions notify through completion_
+        if(telemetry_->publish(event) && callbacks_.notifier
+           && type != TelemetryEvent::Type::Sample && type != TelemetryEvent::Type::RunFinished){
+            callbacks_.notifier->notify();
+        }
+    }
+
+    Filter filter_;
+    Detector detector_;
 
     PumpDiagnostics diagnostics_;
 
 public:
+    // sample period of the run loop of runForPulses; a scheduler passes its
+    // own to beginRun
+    static constexpr unsigned long SampleIntervalMs = 2;
+    // baseline tracking, time constants of 2^shift samples: about two
+    // seconds while running, eight reads while idle
+    static constexpr unsigned BaselineRunShift = 10;
+    static constexpr unsigned BaselineIdleShift = 3;
+    // relative change of a calibration value that makes autoSave write
+    static constexpr float CalibrationSaveTolerance = 0.1f;
+
 //constructor
     MonitoredPump(uint8_t enablePin, uint8_t touchPin, float pulsesPerMl, size_t approxSamplesPerPulse=0)
         : enablePin_(enablePin), touchPin_(touchPin), 
         pulsesPerMl_(pulsesPerMl), approxSamplesPerPulse_(approxSamplesPerPulse),
-        peakDetector(), troughDetector(true) {}
+        detector_() {}
     void begin() {
-        pinMode(enablePin_, OUTPUT);
-        digitalWrite(enablePin_, LOW);
+        //warm start from the last calibration, if a store is attached
+        restoreCalibration();
+        pumphal::pinMode(enablePin_, OUTPUT);
+        pumphal::rawDigitalWrite(enablePin_, LOW);
         // pinMode(touchPin_, INPUT);
-        threadSafe::touchRead(touchPin_);
+        pumphal::touchRead(touchPin_);
         
-       // Set FSM to timer mode (more predictable)
-        touch_pad_set_fsm_mode(TOUCH_FSM_MODE_TIMER);
-      
-        // Reduce measurement and sleep cycles (faster but noisier)
-        touch_pad_set_meas_time(24, 300);//in 8MHz clock sycles: total of 1.5ms
+        // timer mode FSM and shorter measurement (faster but noisier)
+        pumphal::configureTouch();
         //run touch pad measurement once to set the baseline
-        threadSafe::touchRead(touchPin_);
+        pumphal::touchRead(touchPin_);
     }
 //destructor
     ~MonitoredPump() {
@@ -126,18 +365,96 @@ public:
 //methods
     bool runForPulses(uint32_t pulses, bool fulldiagnostics=false, std::atomic<bool>* abortFlag=nullptr)  override;
     bool volumeSupported(float ml) const override {
-        return ml * pulsesPerMl_ > 5;
+        return ml * pulsesPerMl() > 5;
     }
+    // nominal pulses per ml times the calibration correction
     float pulsesPerMl() const {
-        return pulsesPerMl_;
+        return pulsesPerMl_ * pulsesPerMlCorrection_;
+    }
+    // measured / nominal pulses per ml, e.g. from weighing a dose
+    void setPulsesPerMlCorrection(float correction) {
+        pulsesPerMlCorrection_ = correction > 0 ? correction : 1;
+    }
+    float pulsesPerMlCorrection() const {
+        return pulsesPerMlCorrection_;
+    }
+
+    // Keeps the learned state (baseline, samples per pulse, health profile,
+    // stop offset, pulses per ml correction) in store under key, which must
+    // outlive the pump. begin() restores it. Save it with saveCalibration()
+    // from the control loop. With autoSave a completed run saves it when it
+    // moved by more than CalibrationSaveTolerance since the last save; that
+    // is a flash write in the sampling task, which stalls the other pumps
+    // of a PumpScheduler, so leave it off there.
+    // The pulses per ml correction is only what setPulsesPerMlCorrection
+    // set, it is not measured by the pump.
+    void attachCalibrationStore(CalibrationStore* store, const char* key, bool autoSave=false) {
+        calibrationStore_ = store;
+        calibrationKey_ = key;
+        autoSaveCalibration_ = autoSave;
+    }
+    // call while the pump is idle
+    bool restoreCalibration() {
+        PumpCalibration calibration;
+        if(!calibrationStore_ || !calibrationStore_->load(calibrationKey_, calibration)){
+            return false;
+        }
+        applyCalibration(calibration);
+        savedCalibration_ = calibration;
+        return true;
+    }
+    bool saveCalibration() const {
+        const PumpCalibration current = calibration();
+        if(!calibrationStore_ || !calibrationStore_->save(calibrationKey_, current)){
+            return false;
+        }
+        savedCalibration_ = current;
+        return true;
+    }
+    PumpCalibration calibration() const {
+        PumpCalibration calibration;
+        calibration.baseline = baseline_.value();
+        calibration.samplesPerPulse = approxSamplesPerPulse_;
+        calibration.stopOffsetUs = stopOffsetUs_;
+        calibration.pulsesPerMlCorrection = pulsesPerMlCorrection_;
+        calibration.profile = profile_;
+        return calibration;
+    }
+    void applyCalibration(const PumpCalibration& calibration) {
+        baseline_.reset(calibration.baseline);
+        approxSamplesPerPulse_ = calibration.samplesPerPulse;
+        stopOffsetUs_ = calibration.stopOffsetUs;
+        setPulsesPerMlCorrection(calibration.pulsesPerMlCorrection);
+        profile_ = calibration.profile;
     }
     uint32_t getApproxSamplesPerPulse() const {
         return approxSamplesPerPulse_;
     }
+    // beginRun reads the pad once before switching the pump on, as an idle
+    // sample for the baseline. Turn it off to replay recorded traces
+    // through processSample, where there is no pad to read; the run then
+    // starts from the tracked (or applied) baseline.
+    void setIdleReadAtStart(bool read) {
+        idleReadAtStart_ = read;
+    }
+    // Reads the idle touch value into the baseline tracking. Call now and
+    // then (e.g. once a second) from the control loop between runs, so the
+    // baseline follows temperature drift. Pumps driven by a PumpScheduler
+    // get this from the scheduler instead, see setIdleBaselineInterval().
+    void updateBaseline() {
+        if(isBusy()) return;
+        addIdleSample(pumphal::touchRead(touchPin_));
+    }
+    void addIdleSample(uint32_t raw_value) override {
+        baseline_.add(raw_value, BaselineIdleShift);
+    }
+    uint32_t baseline() const {
+        return baseline_.value();
+    }
     bool runForMl(float ml, bool fulldiagnostics=false) override;
 
     void stop() override {
-        threadSafe::digitalWrite(enablePin_, LOW);
+        pumphal::digitalWrite(enablePin_, LOW);
     }
 
     const PumpDiagnostics& getDiagnostics() const {
@@ -146,102 +463,480 @@ public:
     void clearDiagnostics() {
         diagnostics_.clear();
     }
-    
+    // Reserves the diagnostics buffers once, for runs of up to maxPulses
+    // pulses with history and maxSamples samples of full shape. Call it at
+    // setup; runs then use no heap for their diagnostics. Runs that would
+    // not fit are refused with RunResult::DiagnosticsOverflow; for the full
+    // shape that is an estimate from the samples per pulse (which must be
+    // known) and the encoded size of the last run, see shapeFits(). On ESP32
+    // with PSRAM, blocks above CONFIG_SPIRAM_MALLOC_ALWAYSINTERNAL bytes
+    // are placed in PSRAM by malloc, so large buffers do not use up the
+    // internal RAM.
+    void reserveDiagnostics(std::size_t maxPulses, std::size_t maxSamples = 0) {
+        diagnostics_.reserveFixed(maxPulses, maxSamples);
+    }
+    // keep every pulse time and value in the diagnostics, not only the
+    // streaming statistics. Always on for runs with fulldiagnostics.
+    void setKeepPulseHistory(bool keep) {
+        keepPulseHistory_ = keep;
+    }
+    RunResult lastResult() const override {
+        return lastResult_;
+    }
+    // Publishes run start/finish, pulses, progress and (decimated) samples
+    // into the channel while running, without ever blocking the sampling
+    // loop. Set while the pump is idle; nullptr detaches.
+    void attachTelemetry(TelemetryChannel* channel) override {
+        telemetry_ = channel;
+    }
+    void setCallbacks(const PumpCallbacks& callbacks) override {
+        callbacks_ = callbacks;
+        completion_.setNotifier(callbacks.notifier);
+        dispatchedSequence_ = completion_.sequence();
+    }
+    std::size_t dispatchEvents() override;
+    void setSamplingMode(SamplingMode mode) {
+        samplingMode_ = mode;
+    }
+    SamplingMode samplingMode() const {
+        return samplingMode_;
+    }
+    // A pulse is only detected Lookahead samples after it happened, so the
+    // pump keeps running for that long after the last pulse. With predictive
+    // stop the power is cut at the predicted time of the last pulse instead
+    // (last pulse + pulse period + learned offset), plus one sample period:
+    // a cut on the extremum itself flattens it, and the pulse may go
+    // unseen. Sampling continues for a few samples to find the real last
+    // pulse; the error goes into the diagnostics and corrects the offset for
+    // the next run, aiming at the last pulse one sample before the cut. If
+    // the last pulse is not seen, the run ends with RunResult::LastPulseMissed.
+    // Runs of a single pulse have no pulse to predict from and stop when
+    // the pulse is detected.
+    void setPredictiveStop(bool enable) {
+        predictiveStop_ = enable;
+    }
+    bool predictiveStop() const {
+        return predictiveStop_;
+    }
+    // learned correction of the predicted stop time in µs
+    int32_t stopOffsetUs() const {
+        return stopOffsetUs_;
+    }
+    void setStopOffsetUs(int32_t offset) {
+        stopOffsetUs_ = offset;
+    }
+    // Stop a run early when the rolling amplitude or pulse period leaves
+    // the learned profile (air, clog, broken hose) or the pulses stop.
+    // Needs at least one completed run (or setProfile) to have a profile.
+    void setFaultDetection(bool enable) {
+        faultDetection_ = enable;
+    }
+    bool faultDetection() const {
+        return faultDetection_;
+    }
+    const PumpProfile& profile() const {
+        return profile_;
+    }
+    void setProfile(const PumpProfile& profile) {
+        profile_ = profile;
+    }
+    void setHealthLimits(const HealthLimits& limits) {
+        healthLimits_ = limits;
+    }
+    const HealthLimits& healthLimits() const {
+        return healthLimits_;
+    }
+
+    bool beginRun(uint32_t pulses, bool fulldiagnostics, uint32_t samplePeriodUs) override;
+    uint8_t touchPin() const override {
+        return touchPin_;
+    }
+    bool processSample(uint32_t raw_value, unsigned long timeUs) override;
+    void endRun(RunResult result) override;
+#if defined(PUMP_INSTRUMENTATION)
+    SamplingInstrumentation& instrumentation() override {
+        return diagnostics_.instrumentation;
+    }
+#endif
+
+protected:
+    // ends a request that is not run, with the reason
+    void rejectRun(RunResult result);
 };
 
 
-template<std::size_t  Lookahead>
-bool MonitoredPump<Lookahead>::runForPulses(uint32_t pulses, bool fulldiagnostics, std::atomic<bool>* abortFlag)  {
-    if(pulses == 0){
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+bool MonitoredPump<Lookahead, Detector, Filter>::runForPulses(uint32_t pulses, bool fulldiagnostics, std::atomic<bool>* abortFlag)  {
+    if(!beginRun(pulses, fulldiagnostics, SampleIntervalMs * 1000)){
         return false;
     }
-    //set up the detectors
-    peakDetector.clear();
-    troughDetector.clear();
+    pumphal::SampleTimer timer;
+    //falls back to delay() if the timer can't be set up, wait() would block forever
+    const bool timed = samplingMode_ == SamplingMode::Timer && timer.start(SampleIntervalMs * 1000);
+    bool completed = false;
+    while(!completed){
+        if (abortFlag && abortFlag->load(std::memory_order_relaxed)) {
+            break;                // aborted early
+        }
+        //read the current value, timestamped at capture
+        unsigned long captureTime = pumphal::micros();
+#if defined(PUMP_INSTRUMENTATION)
+        uint32_t lockWaitUs = 0;
+        uint32_t raw_value = pumphal::touchRead(touchPin_, &lockWaitUs);
+        diagnostics_.instrumentation.sample(captureTime, pumphal::micros(), lockWaitUs);
+#else
+        uint32_t raw_value = pumphal::touchRead(touchPin_);
+#endif
+        completed = processSample(raw_value, captureTime);
+#if defined(PUMP_INSTRUMENTATION)
+        diagnostics_.instrumentation.processed(pumphal::micros());
+#endif
+        if(completed){
+            break;
+        }
+        if(timed){
+            timer.wait();//blocks on a semaphore - ok for watchdog
+        }else{
+            pumphal::delay(SampleIntervalMs);//this will call vTaskDelay under the hood - ok for watchdog; 
+            // delayMicroseconds does not
+        }
+    }
+    timer.stop();
+    diagnostics_.missedSamples = timer.missed();
+    endRun(completed ? RunResult::Completed : RunResult::Aborted);
+    return lastResult_ == RunResult::Completed;
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+bool MonitoredPump<Lookahead, Detector, Filter>::beginRun(uint32_t pulses, bool fulldiagnostics, uint32_t samplePeriodUs)  {
+    completion_.reset();
+    if(pulses == 0 || samplePeriodUs == 0){
+        rejectRun(RunResult::InvalidRequest);
+        return false;
+    }
+    const bool keepHistory = keepPulseHistory_ || fulldiagnostics;
+    if(diagnostics_.fixedCapacity()){
+        //refuse runs that don't fit, rather than cut their records short
+        const bool historyFits = !keepHistory || pulses+1 <= diagnostics_.historyCapacity();
+        if(!historyFits || (fulldiagnostics && !shapeFits(pulses))){
+            rejectRun(RunResult::DiagnosticsOverflow);
+            return false;
+        }
+    }
+    samplePeriodUs_ = samplePeriodUs;
+    //set up the detector
+    detector_.clear();
     //set up the diagnostics
     //read the baseline
     diagnostics_.clear();
-    diagnostics_.baseline = threadSafe::touchRead(touchPin_);
-    if(capBaseline_ == 0){
-        capBaseline_ = diagnostics_.baseline;
+    if(idleReadAtStart_){
+        diagnostics_.baseline = pumphal::touchRead(touchPin_);
+        //the pump is still off, so this is an idle read
+        addIdleSample(diagnostics_.baseline);
+    }else{
+        diagnostics_.baseline = baseline_.value();
+    }
+    diagnostics_.setKeepHistory(keepHistory);
+#if defined(PUMP_INSTRUMENTATION)
+    diagnostics_.instrumentation.begin(samplePeriodUs_);
+#endif
+    if(diagnostics_.keepsHistory() && !diagnostics_.fixedCapacity()){
+        diagnostics_.pulseTimes.reserve(pulses+1);
+        diagnostics_.valuesAtPulses.reserve(pulses+1);
     }
-    diagnostics_.pulseTimes.reserve(pulses+1);
-    diagnostics_.valuesAtPulses.reserve(pulses+1);
-    if(fulldiagnostics && approxSamplesPerPulse_ > 0){
-        //add some extra space to the full shape vector
-        diagnostics_.fullShape.reserve(approxSamplesPerPulse_ * (pulses+10));
-        diagnostics_.isPulse.reserve(approxSamplesPerPulse_ * (pulses+10));
+    if(approxSamplesPerPulse_ > 0){
+        //histogram covers twice the expected pulse interval
+        diagnostics_.intervalHistogram.setBinWidth(
+            approxSamplesPerPulse_ * samplePeriodUs_ * 2 / IntervalHistogram::Bins);
+    }
+    if(fulldiagnostics && approxSamplesPerPulse_ > 0 && !diagnostics_.fixedCapacity()){
+        //add some extra space to the full shape trace
+        diagnostics_.fullShape.reserve(approxSamplesPerPulse_ * (pulses+10) / Filter::Decimation, pulses+10);
     }
 
-    //pre-fill the lookahead buffers
-    for(size_t i=0; i<Lookahead; ++i){
-        peakDetector.addSample(capBaseline_);
-        troughDetector.addSample(capBaseline_);
+    //settle the filters on the baseline
+    const uint32_t baseline = baseline_.value();
+    filter_.reset(baseline);
+    //adaptive detectors follow the pulse length. The detector is not
+    //pre-filled: the pump rests on an extremum of its signal, which a
+    //window of made-up samples would report as a pulse right at the start,
+    //so detection waits for a full window (2*lookahead+1) of real samples
+    detector_.retune(approxSamplesPerPulse_ / Filter::Decimation);
+    sampleTimes_.fill(pumphal::micros());
+    sampleTimePos_ = 0;
+    remainingPulses_ = pulses;
+    totalSamples_ = 0;
+    fulldiagnostics_ = fulldiagnostics;
+    lastResult_ = RunResult::None;
+    requestedPulses_ = pulses;
+    stopPending_ = false;
+    powerCut_ = false;
+    fault_ = RunResult::None;
+    health_.begin(profile_, healthLimits_, pumphal::micros());
+    if(telemetry_){
+        sampleCountdown_ = telemetry_->sampleDecimation();
+        progressCountdown_ = telemetry_->progressInterval();
+        publish(TelemetryEvent::Type::RunStarted, 0, pumphal::micros(), 0, pulses);
     }
-    unsigned long totalSamples = 0;
     //run the pump
-    threadSafe::digitalWrite(enablePin_, HIGH);
-    const unsigned long intervalMs = 2;
-    float raw_average = 0.0;
-    while(pulses > 0){
-        if (abortFlag && abortFlag->load(std::memory_order_relaxed)) {
-            threadSafe::digitalWrite(enablePin_, LOW);
-            return false;                // aborted early
-        }
-        //read the current value
-        unsigned long raw_value = threadSafe::touchRead(touchPin_);
-        raw_average += raw_value;
-        int32_t value = raw_value - capBaseline_;//can subtract directly
-        //add the sample to the detectors, raw here as it needs to be >0
-        bool peak = peakDetector.addSample(raw_value);
-        bool trough = troughDetector.addSample(raw_value);
-        // if either is true
-        if(peak || trough){
-            //a pulse was detected
-            diagnostics_.pulseTimes.push_back(micros() - (peakDetector.centerOffset() * intervalMs * 1000));//roughly
-            
-            int32_t valAtPulse = peakDetector.getCenterValue();
-            if(trough)
-                valAtPulse = troughDetector.getCenterValue();
-            diagnostics_.valuesAtPulses.push_back(valAtPulse);
-            
-            --pulses;
-        }
-        if(fulldiagnostics){
-            diagnostics_.fullShape.push_back(value);
-            diagnostics_.isPulse.push_back(false);
-            //now if this was a pulse, set the entry in the past defined by lookahead to true
-            if(peak){
-                int index = diagnostics_.isPulse.size() - peakDetector.centerOffset();
-                if(index >= 0 && index < diagnostics_.isPulse.size())
-                    diagnostics_.isPulse[index] = true;
-            }
-            if(trough){
-                int index = diagnostics_.isPulse.size() - troughDetector.centerOffset();
-                if(index >= 0 && index < diagnostics_.isPulse.size())
-                    diagnostics_.isPulse[index] = true;
-            }
-        }
-        ++totalSamples;
-        delay(intervalMs);//this will call vTaskDelay under the hood - ok for watchdog; 
-        // delayMicroseconds does not
-    }
-    //update the approxSamplesPerPulse
-    approxSamplesPerPulse_ = totalSamples / diagnostics_.pulseTimes.size();
-    raw_average /= totalSamples;
-    capBaseline_ = raw_average;
-    //stop the pump
-    threadSafe::digitalWrite(enablePin_, LOW);
-    //return the diagnostics
+    pumphal::digitalWrite(enablePin_, HIGH);
     return true;
 }
 
-template<std::size_t  Lookahead>
-bool MonitoredPump<Lookahead>::runForMl(float ml, bool fulldiagnostics)  {
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+bool MonitoredPump<Lookahead, Detector, Filter>::processSample(uint32_t raw_value, unsigned long timeUs)  {
+    //the running signal swings around the baseline, follow it slowly
+    baseline_.add(raw_value, BaselineRunShift);
+    const uint32_t baseline = baseline_.value();
+    int32_t value = raw_value - baseline;//can subtract directly
+    //a decimating filter only passes on every few samples
+    int32_t filtered = 0;
+    const bool conditioned = filter_.process(raw_value, filtered);
+    PulseType pulse = PulseType::None;
+    if(conditioned){
+        sampleTimes_[sampleTimePos_] = timeUs;
+        if(++sampleTimePos_ == sampleTimes_.size()) sampleTimePos_ = 0;
+        pulse = detector_.addSample(filtered);
+    }
+    if(pulse != PulseType::None){
+        //a pulse was detected around the center sample, interpolate its
+        //time between the capture times of the center and a neighbour
+        const std::size_t size = sampleTimes_.size();
+        std::size_t pos = (sampleTimePos_ + size - detector_.centerOffset() - 2) % size;
+        const unsigned long before = sampleTimes_[pos];
+        if(++pos == size) pos = 0;
+        const unsigned long center = sampleTimes_[pos];
+        if(++pos == size) pos = 0;
+        const unsigned long after = sampleTimes_[pos];
+        const float offset = detector_.pulseOffset();
+        const unsigned long span = offset < 0 ? center - before : after - center;
+        unsigned long pulseTime = center + static_cast<long>(offset * static_cast<float>(span));
+        float valAtPulse = detector_.pulseValue();
+        diagnostics_.addPulse(pulseTime, valAtPulse);
+#if defined(PUMP_INSTRUMENTATION)
+        diagnostics_.instrumentation.pulse(pulse);
+#endif
+        if(faultDetection_){
+            fault_ = toRunResult(health_.addPulse(pulseTime, valAtPulse));
+        }
+        
+        --remainingPulses_;
+        lastPulseTimeUs_ = pulseTime;
+        if(predictiveStop_ && remainingPulses_ == 1){
+            predictStop(pulseTime);
+        }
+        if(telemetry_){
+            publish(TelemetryEvent::Type::Pulse, static_cast<uint8_t>(pulse), pulseTime,
+                    static_cast<int32_t>(valAtPulse + 0.5f), requestedPulses_ - remainingPulses_);
+        }
+    }
+    if(telemetry_){
+        if(sampleCountdown_ > 0 && --sampleCountdown_ == 0){
+            sampleCountdown_ = telemetry_->sampleDecimation();
+            publish(TelemetryEvent::Type::Sample, 0, timeUs, value, totalSamples_);
+        }
+        if(progressCountdown_ > 0 && --progressCountdown_ == 0){
+            progressCountdown_ = telemetry_->progressInterval();
+            publish(TelemetryEvent::Type::Progress, 0, timeUs, remainingPulses_,
+                    requestedPulses_ - remainingPulses_);
+        }
+    }
+    if(fulldiagnostics_ && conditioned){
+        //the detector input, one entry per detector sample
+        diagnostics_.fullShape.push_back(filtered - filter_.steadyOutput(baseline));
+        //now if this was a pulse, mark the center sample, lookahead samples back
+        if(pulse != PulseType::None && diagnostics_.fullShape.size() > detector_.centerOffset()){
+            diagnostics_.fullShape.markPulse(diagnostics_.fullShape.size() - 1 - detector_.centerOffset());
+        }
+    }
+    if(faultDetection_ && !powerCut_ && fault_ == RunResult::None){
+        fault_ = toRunResult(health_.check(timeUs));
+    }
+    if(fault_ != RunResult::None){
+        //stop right away, endRun records the fault
+        pumphal::digitalWrite(enablePin_, LOW);
+        ++totalSamples_;
+        return true;
+    }
+    if(stopPending_){
+        if(remainingPulses_ == 0){
+            //last pulse came before the predicted time, regular stop
+            recordStop(static_cast<int32_t>(lastPulseTimeUs_ - predictedStopUs_), false);
+        }else if(static_cast<long>(timeUs - predictedStopUs_) >= 0){
+            pumphal::digitalWrite(enablePin_, LOW);
+            stopPending_ = false;
+            powerCut_ = true;
+            predictedStopUs_ = timeUs;
+            //long enough to detect a pulse right at the cut
+            graceSamples_ = (detector_.centerOffset() + 2) * Filter::Decimation;
+        }
+    }else if(powerCut_){
+        if(remainingPulses_ == 0){
+            recordStop(static_cast<int32_t>(lastPulseTimeUs_ - predictedStopUs_), false);
+        }else if(--graceSamples_ == 0){
+            //the pump stopped before the last pulse, it stays outstanding
+            //and endRun reports the run as LastPulseMissed
+            recordStop(static_cast<int32_t>(timeUs - predictedStopUs_), true);
+            ++totalSamples_;
+            return true;
+        }
+    }
+    ++totalSamples_;
+    return remainingPulses_ == 0;
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+void MonitoredPump<Lookahead, Detector, Filter>::predictStop(unsigned long pulseTime)  {
+    //pulse period from this run, or from the previous runs at the start
+    if(diagnostics_.intervalStats.count() > 0){
+        stopPeriodUs_ = diagnostics_.intervalStats.mean();
+    }else{
+        stopPeriodUs_ = approxSamplesPerPulse_ * samplePeriodUs_;
+    }
+    if(stopPeriodUs_ == 0){
+        return; //nothing to predict from, stop when the pulse is detected
+    }
+    //one sample late, so an exact prediction cuts right after the extremum
+    predictedStopUs_ = pulseTime + stopPeriodUs_ + stopOffsetUs_ + samplePeriodUs_;
+    stopPending_ = true;
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+void MonitoredPump<Lookahead, Detector, Filter>::recordStop(int32_t errorUs, bool missed)  {
+    stopPending_ = false;
+    powerCut_ = false;
+    diagnostics_.predictedStop = true;
+    diagnostics_.lastPulseMissed = missed;
+    diagnostics_.stopErrorUs = errorUs;
+    //move the prediction a quarter of the way towards the real pulse one
+    //sample before the cut. A missed pulse may also have happened unnoticed
+    //right at the cut (flat signal afterwards), so only step one sample
+    //later then.
+    const int32_t samplePeriod = static_cast<int32_t>(samplePeriodUs_);
+    const int32_t limit = stopPeriodUs_ / 2;
+    stopOffsetUs_ += missed ? samplePeriod : (errorUs + samplePeriod) / 4;
+    if(stopOffsetUs_ > limit) stopOffsetUs_ = limit;
+    if(stopOffsetUs_ < -limit) stopOffsetUs_ = -limit;
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+bool MonitoredPump<Lookahead, Detector, Filter>::shapeFits(uint32_t pulses) const  {
+    //without samples per pulse there is no estimate, better refuse than
+    //cut the trace short
+    if(approxSamplesPerPulse_ == 0){
+        return false;
+    }
+    //An estimate: the samples per pulse and the bytes per sample (one, plus
+    //the 1/8 reserve() adds, until a run measured it) of the last run, with
+    //a quarter headroom. A faster or noisier run can still overflow, which
+    //sets diagnostics.overflowed.
+    const ShapeTrace& shape = diagnostics_.fullShape;
+    const float bytesPerSample = shapeBytesPerSample_ > 0 ? shapeBytesPerSample_ : 1.125f;
+    const float samples = static_cast<float>(approxSamplesPerPulse_) * (pulses + 1) / Filter::Decimation;
+    const float sampleBytes = samples * bytesPerSample * 1.25f + ShapeTrace::MaxVarintBytes;
+    //two marker bytes cover pulses up to 2^14 samples apart
+    const std::size_t markerBytes = 2 * (static_cast<std::size_t>(pulses) + 1) + ShapeTrace::MaxVarintBytes;
+    return sampleBytes <= shape.sampleCapacityBytes() && markerBytes <= shape.markerCapacityBytes();
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+bool MonitoredPump<Lookahead, Detector, Filter>::calibrationDrifted() const  {
+    const auto moved = [](float saved, float now){
+        return fabs(now - saved) > CalibrationSaveTolerance * fabs(saved) || (saved == 0) != (now == 0);
+    };
+    const PumpCalibration now = calibration();
+    return moved(savedCalibration_.baseline, now.baseline)
+        || moved(savedCalibration_.samplesPerPulse, now.samplesPerPulse)
+        || moved(savedCalibration_.pulsesPerMlCorrection, now.pulsesPerMlCorrection)
+        || moved(savedCalibration_.profile.amplitude, now.profile.amplitude)
+        || moved(savedCalibration_.profile.intervalUs, now.profile.intervalUs)
+        //the stop offset is small around 0, compare it to the sample period
+        || static_cast<uint32_t>(abs(now.stopOffsetUs - savedCalibration_.stopOffsetUs)) > samplePeriodUs_ / 2;
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+void MonitoredPump<Lookahead, Detector, Filter>::endRun(RunResult result)  {
+    //stop the pump
+    pumphal::digitalWrite(enablePin_, LOW);
+    if(fault_ != RunResult::None && result == RunResult::Completed){
+        result = fault_;
+    }
+    if(result == RunResult::Completed && remainingPulses_ > 0 && diagnostics_.lastPulseMissed){
+        result = RunResult::LastPulseMissed;
+    }
+    if(diagnostics_.fullShape.overflowed()){
+        diagnostics_.overflowed = true;
+    }else if(fulldiagnostics_ && !diagnostics_.fullShape.empty()){
+        shapeBytesPerSample_ = diagnostics_.fullShape.bytesPerSample();
+    }
+    if(result == RunResult::Completed && diagnostics_.pulseCount() > 0){
+        profile_.learn(diagnostics_.averageAmplitude(), diagnostics_.averagePulseTime());
+        //update the approxSamplesPerPulse from the pulse intervals; the
+        //samples before the first pulse (the warm-up window and the way to
+        //the first extremum) say nothing about the pulse length
+        if(diagnostics_.intervalStats.count() > 0){
+            approxSamplesPerPulse_ = static_cast<uint32_t>(lround(diagnostics_.intervalStats.mean() / samplePeriodUs_));
+        }else if(approxSamplesPerPulse_ == 0){
+            approxSamplesPerPulse_ = totalSamples_ / diagnostics_.pulseCount();
+        }
+        if(calibrationStore_ && autoSaveCalibration_ && calibrationDrifted()){
+            saveCalibration();
+        }
+    }
+    lastResult_ = result;
+    if(telemetry_){
+        publish(TelemetryEvent::Type::RunFinished, static_cast<uint8_t>(result), pumphal::micros(),
+                0, diagnostics_.pulseCount());
+    }
+    completion_.complete(result, diagnostics_);
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+void MonitoredPump<Lookahead, Detector, Filter>::rejectRun(RunResult result)  {
+    lastResult_ = result;
+    if(telemetry_){
+        publish(TelemetryEvent::Type::RunFinished, static_cast<uint8_t>(result), pumphal::micros(), 0, 0);
+    }
+    completion_.complete(result, diagnostics_);
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+std::size_t MonitoredPump<Lookahead, Detector, Filter>::dispatchEvents()  {
+    std::size_t handled = 0;
+    TelemetryEvent event;
+    while(telemetry_ && telemetry_->poll(event)){
+        ++handled;
+        switch(event.type){
+            case TelemetryEvent::Type::Pulse:
+                if(callbacks_.onPulse) callbacks_.onPulse(callbacks_.context, event.count, event.timeUs);
+                break;
+            case TelemetryEvent::Type::Progress:
+                if(callbacks_.onProgress) callbacks_.onProgress(callbacks_.context, event.count, event.value);
+                break;
+            default:
+                if(callbacks_.onTelemetry) callbacks_.onTelemetry(callbacks_.context, event);
+                break;
+        }
+    }
+    //after the events, which all came before the completion
+    const uint32_t sequence = completion_.sequence();
+    if(sequence != dispatchedSequence_){
+        dispatchedSequence_ = sequence;
+        ++handled;
+        if(callbacks_.onComplete){
+            callbacks_.onComplete(callbacks_.context, completion_.result(), diagnostics_);
+        }
+    }
+    return handled;
+}
+
+template<std::size_t  Lookahead, typename Detector, typename Filter>
+bool MonitoredPump<Lookahead, Detector, Filter>::runForMl(float ml, bool fulldiagnostics)  {
     //calculate the number of pulses needed
-    float pulsesNeeded = ml * pulsesPerMl_;
+    float pulsesNeeded = ml * pulsesPerMl();
     //if this is too low, return an empty diagnostics object
     if(!volumeSupported(ml)){
+        rejectRun(RunResult::InvalidRequest);
         return false;
     }
     return runForPulses(pulsesNeeded, fulldiagnostics);
@@ -0,0 +1,217 @@
+#ifndef PULSE_EXTREMA_DETECTOR_H
+#define PULSE_EXTREMA_DETECTOR_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Result of PulseExtremaDetector::addSample
+enum class PulseType : uint8_t {
+    None = 0,
+    Peak,
+    Trough
+};
+
+// Fixed-capacity monotonic deque over a sliding window.
+// Keeps (value, sample index) pairs such that the front is always the
+// extremum of the window. For equal values the *latest* sample wins, which
+// is exactly what the lookahead criterion needs (strict on the forward side,
+// non-strict on the backward side).
+template<typename T, std::size_t Capacity, bool Max>
+class MonotonicWindow {
+public:
+    struct Entry {
+        T value;
+        uint32_t index;
+    };
+
+    MonotonicWindow() : head_(0), count_(0) {}
+
+    void clear() {
+        head_ = 0;
+        count_ = 0;
+    }
+
+    // Adds a sample and drops entries that can never become the extremum again.
+    void push(T value, uint32_t index) {
+        while (count_ > 0 && dominates(value, back().value)) {
+            --count_;
+        }
+        std::size_t pos = head_ + count_;
+        if (pos >= Capacity) pos -= Capacity;
+        entries_[pos] = Entry{value, index};
+        ++count_;
+    }
+
+    // Drops the front entry if it left the window [newest - window + 1, newest].
+    // The window may be smaller than Capacity, but must not change between clear()s.
+    void expire(uint32_t newest, std::size_t window = Capacity) {
+        // unsigned arithmetic keeps this correct across index wrap-around
+        if (count_ > 0 && newest - entries_[head_].index >= window) {
+            if (++head_ == Capacity) head_ = 0;
+            --count_;
+        }
+    }
+
+    const Entry& front() const { return entries_[head_]; }
+
+private:
+    // true if the new value replaces the old one as extremum candidate
+    static bool dominates(T newValue, T oldValue) {
+        return Max ? !(oldValue > newValue) : !(oldValue < newValue);
+    }
+    const Entry& back() const {
+        std::size_t pos = head_ + count_ - 1;
+        if (pos >= Capacity) pos -= Capacity;
+        return entries_[pos];
+    }
+
+    std::array<Entry, Capacity> entries_;
+    std::size_t head_;
+    std::size_t count_;
+};
+
+// Window, detection and interpolation shared by PulseExtremaDetector and
+// AdaptivePulseDetector, for any lookahead up to MaxLookahead. The
+// lookahead is passed to every addSample and must not change between
+// clear()s.
+template<typename T, std::size_t MaxLookahead>
+class PulseExtremaCore {
+public:
+    static constexpr std::size_t Capacity = 2 * MaxLookahead + 1;
+
+    PulseExtremaCore() : samples_(0), filled_(0), historyPos_(0), offset_(0), value_(0) {
+        history_.fill(T());
+    }
+
+    // Adds a new sample and reports if the center sample of the window
+    // (lookahead samples ago) is a peak or a trough.
+    PulseType addSample(T sample, std::size_t lookahead) {
+        const uint32_t index = samples_++;
+        const std::size_t window = 2 * lookahead + 1;
+        // expire first, so the deques never hold more than Capacity entries
+        maxWindow_.expire(index, window);
+        minWindow_.expire(index, window);
+        maxWindow_.push(sample, index);
+        minWindow_.push(sample, index);
+        history_[historyPos_] = sample;
+        if (++historyPos_ == history_.size()) historyPos_ = 0;
+
+        // wait until the window is full; a separate count, as the sample
+        // index wraps around on long runs
+        if (filled_ < window && ++filled_ < window) return PulseType::None;
+
+        const uint32_t center = index - static_cast<uint32_t>(lookahead);
+        if (maxWindow_.front().index == center) {
+            interpolate(lookahead);
+            return PulseType::Peak;
+        }
+        if (minWindow_.front().index == center) {
+            interpolate(lookahead);
+            return PulseType::Trough;
+        }
+        return PulseType::None;
+    }
+
+    T peakValue() const { return maxWindow_.front().value; }
+    T troughValue() const { return minWindow_.front().value; }
+    float pulseOffset() const { return offset_; }
+    float pulseValue() const { return value_; }
+
+    void clear() {
+        maxWindow_.clear();
+        minWindow_.clear();
+        samples_ = 0;
+        filled_ = 0;
+        history_.fill(T());
+        historyPos_ = 0;
+        offset_ = 0;
+        value_ = 0;
+    }
+
+private:
+    // vertex of the parabola through the center sample and its neighbours;
+    // the sample before the center is lookahead+1 samples before the newest
+    void interpolate(std::size_t lookahead) {
+        const std::size_t size = history_.size();
+        std::size_t pos = (historyPos_ + size - lookahead - 2) % size;
+        const float before = static_cast<float>(history_[pos]);
+        if (++pos == size) pos = 0;
+        const float center = static_cast<float>(history_[pos]);
+        if (++pos == size) pos = 0;
+        const float after = static_cast<float>(history_[pos]);
+
+        const float curvature = before - 2 * center + after;
+        float offset = 0;
+        if (curvature != 0) {
+            offset = 0.5f * (before - after) / curvature;
+            // flat tops (equal neighbours) can push the vertex outside
+            if (offset > 0.5f) offset = 0.5f;
+            if (offset < -0.5f) offset = -0.5f;
+        }
+        offset_ = offset;
+        value_ = center - 0.25f * (before - after) * offset;
+    }
+
+    MonotonicWindow<T, Capacity, true> maxWindow_;
+    MonotonicWindow<T, Capacity, false> minWindow_;
+    uint32_t samples_;
+    std::size_t filled_;    // samples in the window, up to 2*lookahead+1
+    // the last MaxLookahead+2 samples: center, its neighbours and the lookahead
+    std::array<T, MaxLookahead + 2> history_;
+    std::size_t historyPos_;
+    float offset_;
+    float value_;
+};
+
+template<typename T, std::size_t Lookahead>
+class PulseExtremaDetector {
+    /*
+    * Fused peak and trough detector with the same criterion as a pair of
+    * PulseLookaheadDetector (one of them inverted), but with amortized O(1)
+    * cost per sample instead of 2*(2*Lookahead+1) compares.
+    *
+    * The center sample of the 2*Lookahead+1 window is a peak if no earlier
+    * sample in the window is greater and every later sample is strictly
+    * smaller. This is the case exactly when the center is the latest maximum
+    * of the window, i.e. the front of a monotonic max-deque. Troughs work the
+    * same way with a min-deque.
+    *
+    * On a detection, a parabola through the center sample and its two
+    * neighbours gives the sub-sample position (pulseOffset) and the
+    * interpolated extremum value (pulseValue).
+    */
+public:
+    static_assert(Lookahead > 0, "Lookahead must be at least 1");
+    static constexpr std::size_t Capacity = 2 * Lookahead + 1;
+
+    // Adds a new sample and reports if the center sample of the window
+    // (Lookahead samples ago) is a peak or a trough.
+    PulseType addSample(T sample) {
+        return core_.addSample(sample, Lookahead);
+    }
+
+    // Value of the last detected peak / trough (the current window extremum)
+    T peakValue() const { return core_.peakValue(); }
+    T troughValue() const { return core_.troughValue(); }
+
+    // Interpolated position of the last detected pulse relative to the
+    // center sample, in samples within [-0.5, 0.5], and its interpolated value
+    float pulseOffset() const { return core_.pulseOffset(); }
+    float pulseValue() const { return core_.pulseValue(); }
+
+    // Number of samples between the newest sample and the center sample
+    constexpr std::size_t centerOffset() const {
+        return Lookahead;
+    }
+
+    // the window is fixed, see AdaptivePulseDetector for a tunable one
+    void retune(uint32_t /*samplesPerPulse*/) {}
+
+    void clear() { core_.clear(); }
+
+private:
+    PulseExtremaCore<T, Lookahead> core_;
+};
+
+#endif // PULSE_EXTREMA_DETECTOR_H
@@ -0,0 +1,136 @@
+#ifndef PULSE_STATISTICS_H
+#define PULSE_STATISTICS_H
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// Running mean, deviation, min and max in constant memory (Welford's method).
+// The deviation is the population standard deviation, as in the original
+// full-history PumpDiagnostics statistics.
+class RunningStats {
+public:
+    RunningStats() { clear(); }
+
+    void add(float x) {
+        ++n_;
+        float delta = x - mean_;
+        mean_ += delta / n_;
+        m2_ += delta * (x - mean_);
+        if (x < min_) min_ = x;
+        if (x > max_) max_ = x;
+    }
+
+    void clear() {
+        n_ = 0;
+        mean_ = 0;
+        m2_ = 0;
+        min_ = INFINITY;
+        max_ = -INFINITY;
+    }
+
+    uint32_t count() const { return n_; }
+    float mean() const { return mean_; }
+    float deviation() const { return n_ > 0 ? std::sqrt(m2_ / n_) : 0.0f; }
+    // not min()/max(), some Arduino cores define those as macros
+    float lowest() const { return n_ > 0 ? min_ : 0.0f; }
+    float highest() const { return n_ > 0 ? max_ : 0.0f; }
+
+    // rebuilds the state from the values above, e.g. after deserializing
+    void restore(uint32_t count, float mean, float deviation, float lowest, float highest) {
+        clear();
+        if (count == 0) return;
+        n_ = count;
+        mean_ = mean;
+        m2_ = deviation * deviation * count;
+        min_ = lowest;
+        max_ = highest;
+    }
+
+private:
+    uint32_t n_;
+    float mean_;
+    float m2_;
+    float min_;
+    float max_;
+};
+
+// Level of a slowly drifting signal (the touch baseline), as an integer
+// exponential moving average: level += (sample - level) / 2^shift.
+// The shift is given per sample, so one tracker can follow the idle signal
+// quickly and the running pump (which swings around the baseline) slowly.
+// The level has 12 fraction bits, samples must stay below 2^19.
+class BaselineTracker {
+public:
+    static constexpr unsigned FractionBits = 12;
+
+    BaselineTracker() : level_(0), valid_(false) {}
+
+    void add(uint32_t sample, unsigned shift) {
+        const int32_t scaled = static_cast<int32_t>(sample << FractionBits);
+        if (!valid_) {
+            level_ = scaled;
+            valid_ = true;
+            return;
+        }
+        level_ += (scaled - level_) / (int32_t(1) << shift);
+    }
+
+    // starts over at level, e.g. from a stored calibration. 0 clears.
+    void reset(uint32_t level) {
+        level_ = static_cast<int32_t>(level << FractionBits);
+        valid_ = level > 0;
+    }
+
+    bool valid() const { return valid_; }
+    // rounded to the nearest count
+    uint32_t value() const {
+        return static_cast<uint32_t>((level_ + (int32_t(1) << (FractionBits - 1))) >> FractionBits);
+    }
+
+private:
+    int32_t level_;
+    bool valid_;
+};
+
+// Coarse histogram of pulse intervals with fixed, linear bins.
+// Intervals beyond the last bin are counted in the last bin.
+// If no bin width is set, it is derived from the first interval such that
+// the histogram covers twice that interval.
+class IntervalHistogram {
+public:
+    static constexpr std::size_t Bins = 16;
+
+    IntervalHistogram() : binWidthUs_(0) { counts_.fill(0); }
+
+    void add(uint32_t intervalUs) {
+        if (binWidthUs_ == 0) {
+            binWidthUs_ = intervalUs * 2 / Bins;
+            if (binWidthUs_ == 0) binWidthUs_ = 1;
+        }
+        std::size_t bin = intervalUs / binWidthUs_;
+        if (bin >= Bins) bin = Bins - 1;
+        ++counts_[bin];
+    }
+
+    // 0 means automatic (from the first interval)
+    void setBinWidth(uint32_t binWidthUs) { binWidthUs_ = binWidthUs; }
+    uint32_t binWidth() const { return binWidthUs_; }
+
+    uint32_t operator[](std::size_t bin) const { return counts_[bin]; }
+    void setCount(std::size_t bin, uint32_t count) { counts_[bin] = count; }
+    const std::array<uint32_t, Bins>& counts() const { return counts_; }
+
+    // resets the counts and the bin width
+    void clear() {
+        counts_.fill(0);
+        binWidthUs_ = 0;
+    }
+
+private:
+    std::array<uint32_t, Bins> counts_;
+    uint32_t binWidthUs_;
+};
+
+#endif // PULSE_STATISTICS_H
@@ -1,50 +1,69 @@
 // Pump.cpp
 #include "Pump.h"
+#include <algorithm>
+
+uint32_t InterruptProfile::percentile(float p) const {
+    if (intervalsUs.empty()) return 0;
+    if (p < 0) p = 0;
+    if (p > 1) p = 1;
+    std::vector<uint32_t> sorted(intervalsUs);
+    std::size_t k = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5f);
+    std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+    return sorted[k];
+}
 
 
 // Constructor
 Pump::Pump(int interruptPin, int enablePin, float mlPerPulse)
-    : interruptPin(interruptPin), enablePin(enablePin), mlPerPulse(mlPerPulse), counter(0), lastInterruptTime(0) {}
+    : enablePin(enablePin), interruptPin(interruptPin), counter(0), lastInterruptTime(0), mlPerPulse(mlPerPulse),
+      edgeTimes(nullptr), edgeCapacity(0), edgeCount(0), debounceRejects(0) {}
 
 // Initialize pins
 void Pump::__begin() {
-    pinMode(interruptPin, INPUT_PULLUP); // Set interrupt pin as input with pull-up resistor
-    pinMode(enablePin, OUTPUT);         // Set enable pin as output
-    digitalWrite(enablePin, LOW);       // Ensure pump is initially off
+    pumphal::pinMode(interruptPin, INPUT_PULLUP); // Set interrupt pin as input with pull-up resistor
+    pumphal::pinMode(enablePin, OUTPUT);         // Set enable pin as output
+    pumphal::rawDigitalWrite(enablePin, LOW);       // Ensure pump is initially off
 }
 
 // Interrupt Service Routine (ISR) - no debounce needed with comparator edge
 void IRAM_ATTR Pump::handleInterrupt() {
-    if(counter<0) return; // Prevent counting if not running
-    uint32_t currentTime = micros(); // Get the current time
+    if(counter<=0) return; // Prevent counting if not running
+    uint32_t currentTime = pumphal::micros(); // Get the current time
     if (currentTime - lastInterruptTime > debounceTime) { // Check if debounce time has passed
         lastInterruptTime = currentTime; // Update last interrupt time
+        uint32_t* times = edgeTimes;
+        if (times && edgeCount < edgeCapacity) { // Record the edge when profiling
+            times[edgeCount] = currentTime;
+        }
+        edgeCount = edgeCount + 1;
         if (--counter <= 0) { // Decrement counter and check if target is reached
             stop();           // Stop the pump if target is reached
             counter=-1;
         }
+    } else {
+        debounceRejects = debounceRejects + 1;
     }
 }
 
 // Start the pump
 void Pump::start() {
-    startTime = millis();          // Store the start time
-    lastInterruptTime = micros() - debounceTime; // Initialize the first interrupt time, make sure first interrupt is triggered
+    startTime = pumphal::millis();          // Store the start time
+    lastInterruptTime = pumphal::micros() - debounceTime; // Initialize the first interrupt time, make sure first interrupt is triggered
     pulses = counter;              // Store the target count
-    digitalWrite(enablePin, HIGH); // Enable the pump
+    pumphal::rawDigitalWrite(enablePin, HIGH); // Enable the pump
 }
 
 // Stop the pump
 void Pump::stop() {
-    digitalWrite(enablePin, LOW); // Disable the pump
+    pumphal::rawDigitalWrite(enablePin, LOW); // Disable the pump
     counter = -1; // Set the counter to -1 to indicate the pump is stopped
-    runTime = millis() - startTime; // Calculate the run time
+    runTime = pumphal::millis() - startTime; // Calculate the run time
 }
 
 // Run the pump for a specified amount of milliliters
 void Pump::runForMl(float milliliters) {
     if (isBusy()) return; // Prevent starting if already running
-    counter = static_cast<int16_t>(milliliters / mlPerPulse); // Calculate the target count from milliliters
+    counter = static_cast<int32_t>(milliliters / mlPerPulse); // Calculate the target count from milliliters
     if(counter <= 0) return; // Prevent starting if target is invalid
     start();                                              // Start the pump
 }
@@ -61,34 +80,51 @@ int Pump::getInterruptPin() const {
 }
 
 
-std::vector<uint32_t> Pump::runAndGetInterruptTimes() {
-    if(isBusy()) return {};
-    int pulses = 300;
-    std::vector<uint32_t> times(pulses,0);
-    
-    //use interrupts here
-    runForPulses(pulses);//then count counter changes (interrupts on)
-    int prev_counter = counter;
-    uint32_t timeout = millis() + 15000;
-    while(isBusy()){
-        //counter counts down an is then set to -1, so need safeguard
-        if(prev_counter != counter && pulses - counter < times.size() && pulses - counter >= 0){
-            times[pulses - counter] = micros();
-            prev_counter = counter; 
-        }
-        //timeout, consider that it can overflow
-        if(millis() > timeout){
+bool Pump::profileInterrupts(uint32_t pulses, uint32_t timeoutMs, InterruptProfile& profile) {
+    profile = InterruptProfile();
+    if (isBusy() || pulses == 0) return false;
+
+    // allocated before the run, the ISR only writes into it
+    std::vector<uint32_t> times(pulses, 0);
+    edgeCount = 0;
+    debounceRejects = 0;
+    edgeCapacity = pulses;
+    edgeTimes = times.data();
+
+    runForPulses(static_cast<int>(pulses));
+    const uint32_t startMs = pumphal::millis();
+    while (isBusy()) {
+        if (pumphal::millis() - startMs > timeoutMs) { // wrap-safe
             stop();
-            return {};
+            profile.timedOut = true;
+            break;
         }
+        pumphal::delay(10); // yields, the ISR does the timing
     }
-    //remove first 
-    times.erase(times.begin());
-    std::vector<uint32_t> times_diff(times.size()-1,0);
-    //only consider difference between times
-    for(int i = 0; i < times_diff.size(); i++){
-        times_diff[i] = times[i+1] - times[i];
+    edgeTimes = nullptr;
+    edgeCapacity = 0;
+
+    uint32_t edges = edgeCount < pulses ? edgeCount : pulses;
+    profile.edges = edges;
+    profile.debounceRejects = debounceRejects;
+    if (edges > 1) {
+        profile.intervalsUs.reserve(edges - 1);
+        for (uint32_t i = 1; i < edges; ++i) {
+            uint32_t interval = times[i] - times[i - 1];
+            profile.intervalsUs.push_back(interval);
+            profile.stats.add(interval);
+        }
+        profile.histogram.setBinWidth(
+            static_cast<uint32_t>(profile.stats.mean() * 2 / IntervalHistogram::Bins));
+        for (uint32_t interval : profile.intervalsUs) {
+            profile.histogram.add(interval);
+        }
     }
-    //remove first
-    return times_diff;
+    return !profile.timedOut;
+}
+
+std::vector<uint32_t> Pump::runAndGetInterruptTimes() {
+    InterruptProfile profile;
+    if (!profileInterrupts(300, 15000, profile)) return {};
+    return profile.intervalsUs;
 }
@@ -1,15 +1,29 @@
 #ifndef PUMP_H
 #define PUMP_H
 
-#include <Arduino.h>
+#include "PumpHal.h"
+#include "PulseStatistics.h"
 #include <vector>
 
+// Result of Pump::profileInterrupts
+struct InterruptProfile {
+    uint32_t edges = 0;            // accepted interrupt edges
+    uint32_t debounceRejects = 0;  // edges dropped by the debounce
+    bool timedOut = false;
+    std::vector<uint32_t> intervalsUs; // between consecutive accepted edges
+    RunningStats stats;
+    IntervalHistogram histogram;   // spans twice the mean interval
+
+    // interval below which the fraction p (0..1) of the intervals lies
+    uint32_t percentile(float p) const;
+};
+
 
 class Pump {
 private:
     int enablePin;             // Pin to enable or disable the pump
     int interruptPin;          // Pin connected to the interrupt signal
-    volatile int16_t counter;           // Counter to track pulses
+    volatile int32_t counter;           // Counter to track pulses
     uint32_t lastInterruptTime; // Time of the last interrupt (for debouncing)
     float mlPerPulse;          // Milliliters per pulse (calibrated value)
     static constexpr unsigned long debounceTime = 400; // Static debounce time (microseconds)
@@ -17,7 +31,13 @@ private:
     //monitoring
     uint32_t startTime;       // Time when the pump was started
     uint32_t runTime;
-    int16_t pulses;           // Number of pulses
+    int32_t pulses;           // Number of pulses
+
+    //profiling, filled by the ISR
+    uint32_t* volatile edgeTimes;  // preallocated, nullptr when not profiling
+    volatile uint32_t edgeCapacity;
+    volatile uint32_t edgeCount;
+    volatile uint32_t debounceRejects;
 
 public:
     // Constructor
@@ -55,7 +75,13 @@ public:
     }
     int getLastPulses() const {return pulses;}
 
-    // Debugging the hardware
+    // Runs for the given number of pulses while the ISR records the time of
+    // every edge into a buffer allocated up front. Waits with delay(), so no
+    // core is spun. Returns false on timeout, the profile then holds the
+    // edges seen so far.
+    bool profileInterrupts(uint32_t pulses, uint32_t timeoutMs, InterruptProfile& profile);
+
+    // Debugging the hardware, intervals of a 300 pulse run (15 s timeout)
     std::vector<uint32_t> runAndGetInterruptTimes();
 };
 
@@ -68,6 +94,6 @@ public:
 
 #define BEGIN_PUMP(name) \
     name.__begin(); \
-    attachInterrupt(digitalPinToInterrupt(name.getInterruptPin()), name##_interruptHandler, RISING)
+    pumphal::attachInterrupt(name.getInterruptPin(), name##_interruptHandler, RISING)
 
 #endif // PUMP_H
\ No newline at end of file
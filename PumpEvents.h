@@ -0,0 +1,90 @@
+#ifndef PUMP_EVENTS_H
+#define PUMP_EVENTS_H
+
+#include "PumpHal.h"
+#include "PumpTelemetry.h"
+#include <atomic>
+#include <cstdint>
+
+/*
+* Event API of the monitored pumps, see MonitoredPumpBase.
+*
+* Callbacks: the sampling loop only queues events into the telemetry
+* channel of the pump (and completes its PumpCompletion), the callbacks
+* run later in the task that calls dispatchEvents(), so slow callbacks
+* never delay a sample. With a notifier
+* that task can sleep until there is something to dispatch, e.g.
+*
+*   pumphal::TaskNotifier wake;   // setTask() to the control task
+*   callbacks.notifier = &wake;
+*   ...
+*   wake.wait(100);
+*   for (auto* pump : pumps) pump->dispatchEvents();
+*
+* Completion: PumpCompletion is set when the requested run is over, with
+* its result, and wait() blocks until then instead of polling isFinished().
+*/
+
+class PumpDiagnostics;
+enum class RunResult : uint8_t;
+
+// Unset callbacks are skipped. All get the context pointer back.
+struct PumpCallbacks {
+    void* context = nullptr;
+    // a pulse was detected, pulses is the count so far in this run
+    void (*onPulse)(void* context, uint32_t pulses, unsigned long timeUs) = nullptr;
+    // every TelemetryChannel::progressInterval() samples
+    void (*onProgress)(void* context, uint32_t pulses, uint32_t remaining) = nullptr;
+    // a run ended, or a request was refused (RunResult::InvalidRequest etc.).
+    // Taken from the PumpCompletion, not the lossy channel, so it is never
+    // dropped; if several requests ended since the last dispatch, it reports
+    // the latest. The diagnostics are those of the pump, valid until its
+    // next run starts (still those of the run before for a refused request).
+    void (*onComplete)(void* context, RunResult result, const PumpDiagnostics& diagnostics) = nullptr;
+    // all other events (RunStarted, Sample), for consumers of the raw stream
+    void (*onTelemetry)(void* context, const TelemetryEvent& event) = nullptr;
+    // notified when an event other than a sample was queued, and when a
+    // request completes
+    pumphal::TaskNotifier* notifier = nullptr;
+};
+
+// Outcome of the last run request of a pump, like a future but reused from
+// run to run, so there is no heap. Reset when a run is requested, set when
+// it has ended or was refused.
+class PumpCompletion {
+public:
+    PumpCompletion() { done_.set(); }
+
+    bool ready() const { return done_.isSet(); }
+    // blocks until ready(), returns false on timeout
+    bool wait(uint32_t timeoutMs = pumphal::WaitForever) { return done_.wait(timeoutMs); }
+
+    // valid once ready()
+    RunResult result() const { return result_; }
+    // diagnostics of the run, valid until the next run starts; nullptr
+    // before the first run
+    const PumpDiagnostics* diagnostics() const { return diagnostics_; }
+    // number of completed requests, tells runs with the same result apart
+    uint32_t sequence() const { return sequence_.load(std::memory_order_acquire); }
+
+    // used by the pumps and PumpScheduler
+    void setNotifier(pumphal::TaskNotifier* notifier) { notifier_ = notifier; }
+    void reset() { done_.clear(); }
+    void complete(RunResult result, const PumpDiagnostics& diagnostics) {
+        result_ = result;
+        diagnostics_ = &diagnostics;
+        // publishes the fields above to sequence() readers and the waiters
+        sequence_.fetch_add(1, std::memory_order_release);
+        done_.set();
+        if (notifier_) notifier_->notify();
+    }
+
+private:
+    pumphal::Event done_;
+    RunResult result_ = RunResult();
+    const PumpDiagnostics* diagnostics_ = nullptr;
+    std::atomic<uint32_t> sequence_{0};
+    pumphal::TaskNotifier* notifier_ = nullptr;
+};
+
+#endif // PUMP_EVENTS_H
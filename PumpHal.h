@@ -0,0 +1,41 @@
+#ifndef PUMP_HAL_H
+#define PUMP_HAL_H
+
+/*
+* Hardware abstraction layer for the pump library.
+*
+* All hardware access of the pump classes (touch pads, GPIO, interrupts,
+* time and tasks) goes through the pumphal namespace. On the ESP32
+* (ARDUINO defined) the calls forward to Arduino/ESP-IDF, see EspHal.h.
+* Everywhere else the Linux backend in HostHal.h is used, which runs on a
+* virtual clock and takes its signals from simulated devices (PumpSimulator.h),
+* so the library can be profiled and tested off-device.
+*
+* Both backends provide:
+*   uint32_t      touchRead(uint8_t pin, lockWaitUs = nullptr)  lockWaitUs: time waited for the touch lock
+*   void          configureTouch()
+*   bool          addTouchPad(uint8_t pin)                      pad joins the hardware sweep
+*   bool          touchReadAll(pins, count, values, lockWaitUs = nullptr)  latest values of many pads at once, false on a read error
+*   uint32_t      touchSweepUs(count)                          time of one sweep over count pads
+*   void          pinMode(uint8_t pin, uint8_t mode)
+*   void          digitalWrite(uint8_t pin, uint8_t level)     thread-safe, task context
+*   void          rawDigitalWrite(uint8_t pin, uint8_t level)  no locking, ISR safe
+*   unsigned long micros() / millis()                          32 bit, wrap like Arduino
+*   uint64_t      micros64()                                   never wraps
+*   void          delay(uint32_t ms)
+*   void          attachInterrupt(uint8_t pin, void (*handler)(), int mode)
+*   SpinLock      lock() / unlock() / lockFromIsr() / unlockFromIsr()
+*   SampleTimer   start(periodUs) / wait() / stop() / missed()   drift-free periodic pacing
+*   TaskHandle    createTask(...) / deleteCurrentTask() / parkCurrentTask() / deleteTask(h)
+*   TaskNotifier  setTask(h) / notify() / wait(timeoutMs)          wakes one worker task
+*   Event         set() / clear() / isSet() / wait(timeoutMs)      flag for any number of waiters
+*   WaitForever   timeout that never expires
+*/
+
+#if defined(ARDUINO)
+#include "EspHal.h"
+#else
+#include "HostHal.h"
+#endif
+
+#endif // PUMP_HAL_H
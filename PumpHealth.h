@@ -0,0 +1,130 @@
+#ifndef PUMP_HEALTH_H
+#define PUMP_HEALTH_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <math.h>
+
+// fault signatures recognized by PumpHealthMonitor
+enum class PumpFault : uint8_t {
+    None = 0,
+    DryRun,     // amplitude collapsed: the pump moves air
+    Clog,       // pulse period much longer than usual: more resistance
+    HoseBreak,  // pulse period much shorter than usual: less resistance
+    Stalled     // no pulse at all for several periods
+};
+
+// Typical amplitude and pulse period of a healthy pump, learned from
+// completed runs (exponential average over runs).
+struct PumpProfile {
+    float amplitude = 0;   // mean peak to trough difference
+    float intervalUs = 0;  // mean time between pulses
+    uint32_t runs = 0;
+
+    bool valid() const { return runs > 0 && amplitude > 0 && intervalUs > 0; }
+
+    void learn(float runAmplitude, float runIntervalUs) {
+        if (runAmplitude <= 0 || runIntervalUs <= 0) return;
+        if (runs == 0) {
+            amplitude = runAmplitude;
+            intervalUs = runIntervalUs;
+        } else {
+            amplitude += (runAmplitude - amplitude) / 4;
+            intervalUs += (runIntervalUs - intervalUs) / 4;
+        }
+        ++runs;
+    }
+};
+
+// Thresholds relative to the learned profile
+struct HealthLimits {
+    float dryRunAmplitude = 0.5f;   // rolling amplitude below this share: DryRun
+    float hoseBreakInterval = 0.6f; // rolling period below this share: HoseBreak
+    float clogInterval = 1.6f;      // rolling period above this share: Clog
+    float stallIntervals = 4.0f;    // no pulse for this many periods: Stalled
+};
+
+class PumpHealthMonitor {
+    /*
+    * Online fault detection inside the sampling loop.
+    *
+    * Keeps the amplitude and period of the last Window pulses and compares
+    * their rolling means against a learned PumpProfile, so single outliers
+    * (bubbles, missed pulses) do not trigger. Every call is O(1).
+    * Without a valid profile nothing is reported.
+    */
+public:
+    static constexpr std::size_t Window = 8;
+
+    PumpHealthMonitor() { begin(PumpProfile(), HealthLimits(), 0); }
+
+    void begin(const PumpProfile& profile, const HealthLimits& limits, unsigned long timeUs) {
+        profile_ = profile;
+        limits_ = limits;
+        lastTime_ = timeUs;
+        lastValue_ = 0;
+        pulses_ = 0;
+        filled_ = 0;
+        pos_ = 0;
+        amplitudeSum_ = 0;
+        intervalSum_ = 0;
+    }
+
+    // call for every detected pulse
+    PumpFault addPulse(unsigned long timeUs, float value) {
+        const uint32_t interval = static_cast<uint32_t>(timeUs - lastTime_);
+        const float swing = fabs(value - lastValue_);
+        const bool first = pulses_ == 0;
+        lastTime_ = timeUs;
+        lastValue_ = value;
+        ++pulses_;
+        if (first) return PumpFault::None;
+
+        if (filled_ == Window) {
+            amplitudeSum_ -= amplitudes_[pos_];
+            intervalSum_ -= intervals_[pos_];
+        } else {
+            ++filled_;
+        }
+        amplitudes_[pos_] = swing;
+        intervals_[pos_] = interval;
+        amplitudeSum_ += swing;
+        intervalSum_ += interval;
+        if (++pos_ == Window) pos_ = 0;
+
+        if (!profile_.valid() || filled_ < Window) return PumpFault::None;
+        if (amplitude() < limits_.dryRunAmplitude * profile_.amplitude) return PumpFault::DryRun;
+        const float meanInterval = intervalUs();
+        if (meanInterval < limits_.hoseBreakInterval * profile_.intervalUs) return PumpFault::HoseBreak;
+        if (meanInterval > limits_.clogInterval * profile_.intervalUs) return PumpFault::Clog;
+        return PumpFault::None;
+    }
+
+    // call for every sample, reports a pump that stopped pulsing
+    PumpFault check(unsigned long timeUs) const {
+        if (!profile_.valid()) return PumpFault::None;
+        const uint32_t since = static_cast<uint32_t>(timeUs - lastTime_);
+        if (since > limits_.stallIntervals * profile_.intervalUs) return PumpFault::Stalled;
+        return PumpFault::None;
+    }
+
+    // rolling means over the last Window pulses
+    float amplitude() const { return filled_ > 0 ? amplitudeSum_ / filled_ : 0.0f; }
+    float intervalUs() const { return filled_ > 0 ? static_cast<float>(intervalSum_) / filled_ : 0.0f; }
+
+private:
+    PumpProfile profile_;
+    HealthLimits limits_;
+    unsigned long lastTime_;
+    float lastValue_;
+    uint32_t pulses_;
+    std::size_t filled_;
+    std::size_t pos_;
+    std::array<float, Window> amplitudes_;
+    std::array<uint32_t, Window> intervals_;
+    float amplitudeSum_;
+    uint64_t intervalSum_;
+};
+
+#endif // PUMP_HEALTH_H
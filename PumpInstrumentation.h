@@ -0,0 +1,131 @@
+#ifndef PUMP_INSTRUMENTATION_H
+#define PUMP_INSTRUMENTATION_H
+
+/*
+* Timing counters of the sampling loop, to tell a slow touchRead, a late
+* loop and a noisy signal apart when a dose comes out wrong.
+*
+* Only compiled with PUMP_INSTRUMENTATION defined (e.g. build flag
+* -DPUMP_INSTRUMENTATION). Without it this header declares nothing and the
+* pumps contain no instrumentation code or data at all.
+*
+* The counters of the last run are in PumpDiagnostics::instrumentation.
+* They are filled by MonitoredPump::runForPulses (and so by the
+* AsyncMonitoredPump task) and by PumpScheduler::tick. The nominal period
+* is the sample period the run was begun with (MonitoredPumpBase::beginRun),
+* i.e. the scheduler tick for scheduled pumps.
+*
+* The detectors report every window extremum and have no stage that
+* rejects candidates, so there is no reject count; spurious pulses show up
+* as pulses out of order instead.
+*/
+
+#if defined(PUMP_INSTRUMENTATION)
+
+#include "PumpHal.h"
+#include "PulseStatistics.h"
+#include "PulseExtremaDetector.h"
+#include <cstdint>
+
+class SamplingInstrumentation {
+public:
+    SamplingInstrumentation() { clear(); }
+
+    // start of a run with the nominal sample period of its caller
+    void begin(uint32_t periodUs) {
+        clear();
+        periodUs_ = periodUs;
+        // the histogram covers twice the period, later samples in the last bin
+        loopPeriod.setBinWidth(periodUs * 2 / IntervalHistogram::Bins);
+    }
+
+    // one touchRead, started at captureUs and returned at readUs, of which
+    // lockWaitUs were spent waiting for the touch lock (pumphal::touchRead)
+    void sample(unsigned long captureUs, unsigned long readUs, uint32_t lockWaitUs) {
+        if (samples_ > 0) {
+            const uint32_t period = captureUs - lastCaptureUs_;
+            loopPeriodStats.add(period);
+            loopPeriod.add(period);
+            if (period > periodUs_ + periodUs_ / 2) ++deadlineMisses;
+        }
+        lastCaptureUs_ = captureUs;
+        lastReadUs_ = readUs;
+        ++samples_;
+        touchReadStats.add(readUs - captureUs);
+        touchWaitStats.add(lockWaitUs);
+    }
+
+    // processSample of the last sample returned at doneUs
+    void processed(unsigned long doneUs) {
+        processStats.add(doneUs - lastReadUs_);
+    }
+
+    // a pulse reported by the detector
+    void pulse(PulseType type) {
+        ++pulsesDetected;
+        // peaks and troughs alternate on a clean signal
+        if (type == lastType_) ++pulsesOutOfOrder;
+        lastType_ = type;
+    }
+
+    // time the touch reads of the run waited for the touch lock, in total
+    // and the longest single wait, as measured by the HAL
+    float touchWaitUs() const {
+        return touchWaitStats.mean() * touchWaitStats.count();
+    }
+    float maxTouchWaitUs() const {
+        return touchWaitStats.highest();
+    }
+
+    void clear() {
+        loopPeriodStats.clear();
+        loopPeriod.clear();
+        touchReadStats.clear();
+        touchWaitStats.clear();
+        processStats.clear();
+        deadlineMisses = 0;
+        pulsesDetected = 0;
+        pulsesOutOfOrder = 0;
+        periodUs_ = 0;
+        samples_ = 0;
+        lastCaptureUs_ = 0;
+        lastReadUs_ = 0;
+        lastType_ = PulseType::None;
+    }
+
+    String summary() const {
+        return "Loop period: " + String(loopPeriodStats.mean()) + " +- " + String(loopPeriodStats.deviation())
+            + " µs (max " + String(loopPeriodStats.highest()) + "), deadline misses: " + String(deadlineMisses)
+            + "; touchRead: " + String(touchReadStats.mean()) + " µs (max " + String(touchReadStats.highest())
+            + "), waiting: " + String(touchWaitUs()) + " µs; processing: " + String(processStats.mean())
+            + " µs; pulses: " + String(pulsesDetected) + " (" + String(pulsesOutOfOrder) + " out of order)";
+    }
+
+    // time between consecutive touchRead starts
+    RunningStats loopPeriodStats;
+    IntervalHistogram loopPeriod;
+    // touchRead duration, including the wait for the touch lock
+    RunningStats touchReadStats;
+    // wait for the touch lock per read
+    RunningStats touchWaitStats;
+    // processSample duration
+    RunningStats processStats;
+    // periods longer than 1.5 nominal periods
+    uint32_t deadlineMisses;
+    // detector output; out of order are a second peak (or trough) without
+    // a trough (peak) in between, a sign of spurious pulses from noise.
+    // They are counted as pulses like all others.
+    uint32_t pulsesDetected;
+    uint32_t pulsesOutOfOrder;
+
+private:
+    uint32_t periodUs_;
+    uint32_t samples_;
+    unsigned long lastCaptureUs_;
+    unsigned long lastReadUs_;
+    PulseType lastType_;
+};
+
+#endif // PUMP_INSTRUMENTATION
+
+#endif // PUMP_INSTRUMENTATION_H
@@ -0,0 +1,280 @@
+#ifndef PUMP_SCHEDULER_H
+#define PUMP_SCHEDULER_H
+
+#include "MonitoredPump.h"
+#include "PumpHal.h"
+#include "TouchScanner.h"
+#include <array>
+#include <atomic>
+
+template<std::size_t MaxPumps>
+class PumpScheduler {
+    /*
+    * PumpScheduler class
+    * Services any number (up to MaxPumps) of registered monitored pumps from a
+    * single sampling task. Every tick the task reads the touch pads of all
+    * pumps in one sweep (TouchScanner) and feeds the samples to the
+    * detectors of the running ones, so a rack of pumps needs one task and
+    * one stack instead of one AsyncMonitoredPump task each. The per pump
+    * cost is one slot. Since the pads are measured by the touch hardware in
+    * the background, a tick does not get longer with every pump as with one
+    * blocking touchRead per pump. Ticks are paced by a periodic timer, so
+    * the sample period stays fixed. If a sweep over all pads takes longer
+    * than a tick, the pumps on the scanner get no sample in the ticks
+    * without a fresh frame (see TouchScanner) rather than the old values again.
+    *
+    * Each pump has its own start/abort and completion state. The pumps are
+    * driven through the MonitoredPumpBase run state machine, so they must not
+    * be run directly (runForPulses/runForMl) while registered here.
+    */
+public:
+    using PumpId = int;
+
+    explicit PumpScheduler(unsigned long tickMs = 2)
+        : tickMs_(tickMs), count_(0), idleBaselineTicks_(0), idleTicks_(0), taskHandle_(nullptr) {}
+
+    ~PumpScheduler() { end(); }
+
+    // registers a pump, returns its id or -1 if all slots are taken. Call
+    // before begin(): the sampling task reads the slots without a lock, so
+    // -1 while it is running.
+    PumpId addPump(MonitoredPumpBase& pump) {
+        if (count_ >= MaxPumps || taskAlive_.load()) return -1;
+        slots_[count_].pump = &pump;
+        // pumps on pins the scanner can't take are read one by one
+        slots_[count_].pad = scanner_.addPad(pump.touchPin());
+        return static_cast<PumpId>(count_++);
+    }
+
+    // starts the sampling task
+    bool begin(unsigned priority = 1, int core = 0) {
+        if (taskAlive_.load()) return taskRunning_.load();
+        taskRunning_.store(true);
+        taskAlive_.store(true);
+        bool created = pumphal::createTask(taskFunc, nullptr, 8192, this, priority, &taskHandle_, core);
+        if (!created) {
+            taskRunning_.store(false);
+            taskAlive_.store(false);
+        }
+        return created;
+    }
+
+    // stops the sampling task, running pumps are aborted
+    void end() {
+        if (!taskRunning_.load()) return;
+        for (std::size_t i = 0; i < count_; ++i) abort(static_cast<PumpId>(i));
+        taskRunning_.store(false);
+        // the task exits within one tick
+        while (taskAlive_.load()) {
+            pumphal::delay(tickMs_);
+        }
+    }
+
+    bool startPulses(PumpId id, uint32_t pulses, bool fullDiagnostics = false) {
+        if (!valid(id)) return false;
+        Slot& slot = slots_[id];
+        if (slot.state.load() == SlotState::Starting || slot.state.load() == SlotState::Running) return false;
+        if (slot.pump->isBusy()) return false;
+        slot.pulses = pulses;
+        slot.fullDiagnostics = fullDiagnostics;
+        slot.abort.store(false);
+        slot.pump->completion().reset();
+        slot.state.store(SlotState::Starting, std::memory_order_release);
+        return true;
+    }
+
+    bool startMl(PumpId id, float ml, bool fullDiagnostics = false) {
+        if (!valid(id)) return false;
+        if (!slots_[id].pump->volumeSupported(ml)) return false;
+        return startPulses(id, ml * slots_[id].pump->pulsesPerMl(), fullDiagnostics);
+    }
+
+    // asks the sampling task to stop this pump at the next tick
+    void abort(PumpId id) {
+        if (!valid(id)) return;
+        slots_[id].abort.store(true, std::memory_order_release);
+    }
+
+    bool isBusy(PumpId id) const {
+        if (!valid(id)) return false;
+        SlotState state = slots_[id].state.load(std::memory_order_acquire);
+        return state == SlotState::Starting || state == SlotState::Running;
+    }
+
+    bool isFinished(PumpId id) const {
+        return !isBusy(id);
+    }
+
+    // result of the last finished run of this pump
+    RunResult result(PumpId id) const {
+        if (!valid(id) || isBusy(id)) return RunResult::None;
+        return slots_[id].result;
+    }
+
+    MonitoredPumpBase* pump(PumpId id) {
+        return valid(id) ? slots_[id].pump : nullptr;
+    }
+
+    std::size_t size() const { return count_; }
+
+    // Every ticks ticks, idle pumps get one touch read for their baseline
+    // tracking (MonitoredPump::updateBaseline). 0 (the default) turns it off;
+    // each read takes time from the tick, so keep it rare, e.g. once a second.
+    void setIdleBaselineInterval(uint32_t ticks) {
+        idleBaselineTicks_ = ticks;
+        idleTicks_ = 0;
+    }
+
+    // touch values of the last fresh scan
+    const typename TouchScanner<MaxPumps>::Frame& lastFrame() const {
+        return scanner_.frame();
+    }
+
+    // Services all pumps once. Called by the sampling task every tick;
+    // can also be called from an own loop instead of begin().
+    void tick() {
+        const bool idleRead = idleBaselineTicks_ > 0 && ++idleTicks_ >= idleBaselineTicks_;
+        if (idleRead) idleTicks_ = 0;
+        bool sampling = idleRead;
+        for (std::size_t i = 0; i < count_ && !sampling; ++i) {
+            sampling = slots_[i].state.load(std::memory_order_acquire) == SlotState::Running;
+        }
+        if (sampling && scanner_.size() > 0) {
+            scanner_.scan();
+        }
+#if defined(PUMP_INSTRUMENTATION)
+        const unsigned long scannedTime = pumphal::micros();
+#endif
+        const auto& frame = scanner_.frame();
+        for (std::size_t i = 0; i < count_; ++i) {
+            Slot& slot = slots_[i];
+            SlotState state = slot.state.load(std::memory_order_acquire);
+            if (state == SlotState::Starting) {
+                if (slot.abort.load()) {
+                    cancel(slot);
+                } else if (slot.pump->beginRun(slot.pulses, slot.fullDiagnostics, samplePeriodUs(slot))) {
+                    slot.state.store(SlotState::Running, std::memory_order_release);
+                } else {
+                    slot.result = slot.pump->lastResult();
+                    slot.state.store(SlotState::Idle, std::memory_order_release);
+                }
+            } else if (state == SlotState::Running) {
+                if (slot.abort.load(std::memory_order_relaxed)) {
+                    finish(slot, RunResult::Aborted);
+                    continue;
+                }
+                if (slot.pad >= 0 && !frame.fresh) continue;
+                unsigned long captureTime = frame.timeUs;
+                uint32_t raw_value;
+#if defined(PUMP_INSTRUMENTATION)
+                uint32_t lockWaitUs = frame.lockWaitUs;
+                uint32_t* lockWait = &lockWaitUs;
+#else
+                uint32_t* lockWait = nullptr;
+#endif
+                if (slot.pad >= 0) {
+                    raw_value = frame.values[slot.pad];
+                } else {
+                    captureTime = pumphal::micros();
+                    raw_value = pumphal::touchRead(slot.pump->touchPin(), lockWait);
+                }
+#if defined(PUMP_INSTRUMENTATION)
+                SamplingInstrumentation& instrumentation = slot.pump->instrumentation();
+                instrumentation.sample(captureTime, slot.pad >= 0 ? scannedTime : pumphal::micros(), lockWaitUs);
+#endif
+                const bool completed = slot.pump->processSample(raw_value, captureTime);
+#if defined(PUMP_INSTRUMENTATION)
+                instrumentation.processed(pumphal::micros());
+#endif
+                if (completed) {
+                    finish(slot, RunResult::Completed);
+                }
+            } else if (idleRead && (slot.pad < 0 || frame.fresh)) {
+                slot.pump->addIdleSample(slot.pad >= 0 ? frame.values[slot.pad]
+                                                       : pumphal::touchRead(slot.pump->touchPin()));
+            }
+        }
+    }
+
+private:
+    enum class SlotState : uint8_t {
+        Idle,
+        Starting,
+        Running
+    };
+
+    struct Slot {
+        MonitoredPumpBase* pump = nullptr;
+        int pad = -1;                          // index in the touch frame
+        uint32_t pulses = 0;
+        bool fullDiagnostics = false;
+        RunResult result = RunResult::None;   // written by the sampling task before state
+        std::atomic<bool> abort{false};
+        std::atomic<SlotState> state{SlotState::Idle};
+    };
+
+    // time between two samples of the slot: a tick, or for pads on the
+    // scanner the whole ticks a sweep takes, as the ticks in between have
+    // no fresh frame
+    uint32_t samplePeriodUs(const Slot& slot) const {
+        const uint32_t tickUs = tickMs_ * 1000;
+        if (slot.pad < 0 || scanner_.sweepUs() <= tickUs) return tickUs;
+        return (scanner_.sweepUs() + tickUs - 1) / tickUs * tickUs;
+    }
+
+    bool valid(PumpId id) const {
+        return id >= 0 && static_cast<std::size_t>(id) < count_;
+    }
+
+    void finish(Slot& slot, RunResult result) {
+        slot.pump->endRun(result);
+        slot.result = slot.pump->lastResult();   // a fault overrides Completed
+        slot.state.store(SlotState::Idle, std::memory_order_release);
+    }
+
+    // a run aborted before it started
+    void cancel(Slot& slot) {
+        slot.result = RunResult::Aborted;
+        slot.pump->completion().complete(RunResult::Aborted, slot.pump->getDiagnostics());
+        slot.state.store(SlotState::Idle, std::memory_order_release);
+    }
+
+    static void taskFunc(void* param) {
+        PumpScheduler* self = static_cast<PumpScheduler*>(param);
+        pumphal::SampleTimer timer;
+        bool timed = timer.start(self->tickMs_ * 1000);
+        while (self->taskRunning_.load()) {
+            self->tick();
+            if (timed) {
+                timer.wait();//blocks on a semaphore - ok for watchdog
+            } else {
+                pumphal::delay(self->tickMs_);
+            }
+        }
+        timer.stop();
+        // abort whatever is still running, the pumps must not keep going
+        for (std::size_t i = 0; i < self->count_; ++i) {
+            Slot& slot = self->slots_[i];
+            if (slot.state.load() == SlotState::Running) {
+                self->finish(slot, RunResult::Aborted);
+            } else if (slot.state.load() == SlotState::Starting) {
+                self->cancel(slot);
+            }
+        }
+        self->taskHandle_ = nullptr;
+        self->taskAlive_.store(false);
+        pumphal::deleteCurrentTask();
+    }
+
+    const unsigned long tickMs_;
+    std::array<Slot, MaxPumps> slots_;
+    TouchScanner<MaxPumps> scanner_;
+    std::size_t count_;
+    uint32_t idleBaselineTicks_;
+    uint32_t idleTicks_;
+    std::atomic<bool> taskRunning_{false};   // requested
+    std::atomic<bool> taskAlive_{false};     // task has not exited yet
+    pumphal::TaskHandle taskHandle_;
+};
+
+#endif // PUMP_SCHEDULER_H
@@ -0,0 +1,98 @@
+#ifndef ARDUINO
+
+#include "PumpSimulator.h"
+#include <cmath>
+
+namespace {
+constexpr double kPi = 3.14159265358979323846;
+}
+
+SimulatedPump::SimulatedPump(const SimulatedPumpConfig& config)
+    : config_(config), rng_(config.seed ? config.seed : 1), lastUs_(0), sinceUs_(0),
+      phaseBase_(0), halfCycles_(0), nextEdge_(1), pulseOffset_(0), segment_(0),
+      scale_(1.0), running_(false) {
+    pumphal::host::registerDevice(this);
+}
+
+SimulatedPump::~SimulatedPump() {
+    pumphal::host::unregisterDevice(this);
+}
+
+uint64_t SimulatedPump::pulses() const {
+    return nextEdge_ - 1 - pulseOffset_;
+}
+
+void SimulatedPump::resetPulses() {
+    pulseOffset_ = nextEdge_ - 1;
+}
+
+void SimulatedPump::advanceTo(uint64_t nowUs) {
+    if (nowUs < lastUs_) {
+        // clock was reset, continue with the same phase
+        phaseBase_ = halfCycles_;
+        sinceUs_ = nowUs;
+    }
+    if (running_) {
+        // phase relative to the enable time, so rounding errors do not add up
+        halfCycles_ = phaseBase_ + 2.0 * (nowUs - sinceUs_) / config_.periodUs;
+        // a new pulse starts half way between two extrema
+        int64_t segment = static_cast<int64_t>(std::floor(halfCycles_ + 0.5));
+        if (segment != segment_) {
+            segment_ = segment;
+            scale_ = uniform() < config_.bubbleProbability ? config_.bubbleAmplitude : 1.0;
+        }
+        while (edgeTimeUs(nextEdge_) <= nowUs) ++nextEdge_;
+    }
+    lastUs_ = nowUs;
+}
+
+void SimulatedPump::onPinWrite(uint8_t pin, uint8_t level) {
+    if (pin != config_.enablePin) return;
+    bool running = level != LOW;
+    if (running && !running_) {
+        phaseBase_ = halfCycles_;
+        sinceUs_ = lastUs_;
+        nextEdge_ = static_cast<uint64_t>(std::floor(halfCycles_)) + 1;
+    }
+    running_ = running;
+}
+
+// virtual time at which the phase reaches the given extremum (while running)
+uint64_t SimulatedPump::edgeTimeUs(uint64_t edge) const {
+    double dt = (edge - phaseBase_) * config_.periodUs / 2.0;
+    return sinceUs_ + static_cast<uint64_t>(std::ceil(dt));
+}
+
+bool SimulatedPump::touchRead(uint8_t pin, uint64_t nowUs, uint32_t& value) {
+    if (pin != config_.touchPin) return false;
+    advanceTo(nowUs);
+    double v = config_.baseline
+             + config_.driftPerSecond * (nowUs * 1e-6)
+             + config_.amplitude * scale_ * std::cos(kPi * halfCycles_);
+    if (config_.noise > 0) v += config_.noise * gaussian();
+    value = v > 0 ? static_cast<uint32_t>(std::lround(v)) : 0;
+    return true;
+}
+
+uint64_t SimulatedPump::nextEdgeUs() const {
+    if (!running_ || config_.interruptPin < 0) return UINT64_MAX;
+    return edgeTimeUs(nextEdge_);
+}
+
+// xorshift64*, deterministic on every platform
+double SimulatedPump::uniform() {
+    rng_ ^= rng_ >> 12;
+    rng_ ^= rng_ << 25;
+    rng_ ^= rng_ >> 27;
+    return ((rng_ * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Box-Muller
+double SimulatedPump::gaussian() {
+    double u1 = uniform();
+    double u2 = uniform();
+    if (u1 < 1e-300) u1 = 1e-300;
+    return std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * kPi * u2);
+}
+
+#endif // ARDUINO
@@ -0,0 +1,77 @@
+#ifndef PUMP_SIMULATOR_H
+#define PUMP_SIMULATOR_H
+
+#ifndef ARDUINO
+
+#include "HostHal.h"
+#include <cstdint>
+
+// Configuration of a simulated peristaltic pump
+struct SimulatedPumpConfig {
+    uint8_t enablePin = 0;          // pump moves while this pin is HIGH
+    uint8_t touchPin = 0;           // capacitive signal is read here
+    int interruptPin = -1;          // if >= 0, an edge is raised for every pulse
+    float periodUs = 40000;         // one full oscillation = two pulses (peak + trough)
+    float baseline = 500;           // touch value at rest
+    float amplitude = 20;           // half peak-to-peak
+    float noise = 0;                // gaussian noise, standard deviation
+    float driftPerSecond = 0;       // linear baseline drift (in touch counts)
+    float bubbleProbability = 0;    // chance per pulse that it is pumping air
+    float bubbleAmplitude = 0.3f;   // amplitude factor while pumping air
+    uint64_t seed = 1;              // noise and bubbles are deterministic per seed
+};
+
+/*
+* Simulated peristaltic pump for the host backend.
+*
+* The capacitive signal is baseline + drift*t + amplitude*cos(phase) + noise.
+* The phase only advances while the enable pin is HIGH, so a stopped pump
+* gives a flat (noisy) signal. Every extremum of the cosine is one pulse,
+* matching what MonitoredPump counts. Air bubbles scale the amplitude of
+* single pulses (the half cycle around the extremum).
+*
+* If an interrupt pin is configured, an edge is raised at the exact virtual
+* time of every pulse, which drives the interrupt based Pump and FlowMeter.
+*/
+class SimulatedPump : public pumphal::host::Device {
+public:
+    explicit SimulatedPump(const SimulatedPumpConfig& config);
+    ~SimulatedPump();
+
+    SimulatedPump(const SimulatedPump&) = delete;
+    SimulatedPump& operator=(const SimulatedPump&) = delete;
+
+    // ground truth: pulses completed while enabled since construction/resetPulses()
+    uint64_t pulses() const;
+    void resetPulses();
+    bool isRunning() const { return running_; }
+    const SimulatedPumpConfig& config() const { return config_; }
+
+    // host::Device
+    void advanceTo(uint64_t nowUs) override;
+    void onPinWrite(uint8_t pin, uint8_t level) override;
+    bool touchRead(uint8_t pin, uint64_t nowUs, uint32_t& value) override;
+    uint64_t nextEdgeUs() const override;
+    int edgePin() const override { return config_.interruptPin; }
+
+private:
+    uint64_t edgeTimeUs(uint64_t edge) const;
+    double uniform();
+    double gaussian();
+
+    SimulatedPumpConfig config_;
+    uint64_t rng_;
+    uint64_t lastUs_;
+    uint64_t sinceUs_;       // time the pump was last switched on
+    double phaseBase_;       // phase at sinceUs_
+    double halfCycles_;      // phase in units of pi
+    uint64_t nextEdge_;      // next extremum (pulse) the phase will reach
+    uint64_t pulseOffset_;   // completed pulses at resetPulses()
+    int64_t segment_;        // pulse the current amplitude belongs to
+    double scale_;           // amplitude factor of the current pulse
+    bool running_;
+};
+
+#endif // ARDUINO
+
+#endif // PUMP_SIMULATOR_H
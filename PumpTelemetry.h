@@ -0,0 +1,106 @@
+#ifndef PUMP_TELEMETRY_H
+#define PUMP_TELEMETRY_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// One entry of the live telemetry stream of a pump run (16 bytes)
+struct TelemetryEvent {
+    enum class Type : uint8_t {
+        RunStarted,   // count: requested pulses
+        Sample,       // value: sample minus baseline
+        Pulse,        // value: value at the pulse, count: pulses so far, detail: PulseType
+        Progress,     // count: pulses so far, value: remaining pulses
+        RunFinished   // count: pulses detected, detail: RunResult
+    };
+    Type type;
+    uint8_t detail;
+    uint16_t reserved;
+    uint32_t timeUs;
+    int32_t value;
+    uint32_t count;
+};
+
+/*
+* Lock-free single-producer/single-consumer channel for TelemetryEvents.
+*
+* The sampling loop of a pump publishes into it, a UI or network task drains
+* it concurrently with poll(). Neither side ever blocks: if the consumer falls
+* behind, new events are dropped (and counted) instead of stalling the sampler.
+*
+* Storage is provided by TelemetryRing<Capacity>, so the pump only needs a
+* pointer to this non-template base.
+*/
+class TelemetryChannel {
+public:
+    // producer side, returns false if the channel is full
+    bool publish(const TelemetryEvent& event) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) > mask_) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        slots_[head & mask_] = event;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, returns false if there is nothing to read
+    bool poll(TelemetryEvent& event) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) return false;
+        event = slots_[tail & mask_];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::size_t available() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+    std::size_t capacity() const { return mask_ + 1; }
+    // events lost because the channel was full
+    uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // The settings below are read by the producer at the start of a run,
+    // change them only while the pump is idle.
+    // publish every n-th sample, 0 (default) publishes no samples
+    void setSampleDecimation(uint16_t n) { sampleDecimation_ = n; }
+    uint16_t sampleDecimation() const { return sampleDecimation_; }
+    // publish a progress event every n samples, 0 disables them
+    void setProgressInterval(uint16_t n) { progressInterval_ = n; }
+    uint16_t progressInterval() const { return progressInterval_; }
+
+protected:
+    TelemetryChannel(TelemetryEvent* slots, std::size_t capacity)
+        : slots_(slots), mask_(static_cast<uint32_t>(capacity - 1)) {}
+
+private:
+    TelemetryEvent* const slots_;
+    const uint32_t mask_;
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> dropped_{0};
+    uint16_t sampleDecimation_ = 0;
+    uint16_t progressInterval_ = 50;   // 100 ms at 2 ms sampling
+};
+
+// storage is a base, so it is constructed before the channel points at it
+template<std::size_t Capacity>
+struct TelemetryStorage {
+    std::array<TelemetryEvent, Capacity> storage_{};
+};
+
+template<std::size_t Capacity>
+class TelemetryRing : private TelemetryStorage<Capacity>, public TelemetryChannel {
+public:
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+    TelemetryRing() : TelemetryChannel(this->storage_.data(), Capacity) {}
+
+    TelemetryRing(const TelemetryRing&) = delete;
+    TelemetryRing& operator=(const TelemetryRing&) = delete;
+};
+
+#endif // PUMP_TELEMETRY_H
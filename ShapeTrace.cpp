@@ -0,0 +1,162 @@
+#include "ShapeTrace.h"
+#include <utility>
+
+void ShapeTrace::appendVarint(std::vector<uint8_t>& out, uint32_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+bool ShapeTrace::readVarint(const std::vector<uint8_t>& in, std::size_t& pos, uint32_t& value) {
+    uint32_t v = 0;
+    for (unsigned shift = 0; shift < 7 * MaxVarintBytes && pos < in.size(); shift += 7) {
+        uint8_t b = in[pos++];
+        v |= static_cast<uint32_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            value = v;
+            return true;
+        }
+    }
+    return false; // truncated or overlong
+}
+
+namespace {
+bool fits(const std::vector<uint8_t>& buffer) {
+    return buffer.capacity() - buffer.size() >= ShapeTrace::MaxVarintBytes;
+}
+} // namespace
+
+void ShapeTrace::push_back(int32_t value) {
+    if (fixed_ && (overflowed_ || !fits(samples_))) {
+        overflowed_ = true;
+        return;
+    }
+    // wrapping difference, undone by the wrapping sum in the decoder
+    int32_t delta = static_cast<int32_t>(static_cast<uint32_t>(value) - static_cast<uint32_t>(last_));
+    appendVarint(samples_, zigzag(delta));
+    last_ = value;
+    ++size_;
+}
+
+bool ShapeTrace::markPulse(std::size_t index) {
+    if (index >= size_) return false;
+    if (markers_ > 0 && index <= lastMarker_) return false;
+    if (fixed_ && (overflowed_ || !fits(pulses_))) {
+        overflowed_ = true;
+        return false;
+    }
+    // first marker is stored as its index, the others as gaps
+    std::size_t gap = markers_ > 0 ? index - lastMarker_ : index;
+    appendVarint(pulses_, static_cast<uint32_t>(gap));
+    lastMarker_ = index;
+    ++markers_;
+    return true;
+}
+
+bool ShapeTrace::isPulse(std::size_t index) const {
+    std::size_t pos = 0;
+    std::size_t marker = 0;
+    for (std::size_t i = 0; i < markers_; ++i) {
+        uint32_t gap;
+        if (!readVarint(pulses_, pos, gap)) return false;
+        marker = i == 0 ? gap : marker + gap;
+        if (marker >= index) return marker == index;
+    }
+    return false;
+}
+
+void ShapeTrace::reserve(std::size_t samples, std::size_t pulses) {
+    // most deltas fit in one byte, the vectors grow if they don't
+    samples_.reserve(samples + samples / 8);
+    pulses_.reserve(pulses);
+}
+
+void ShapeTrace::clear() {
+    samples_.clear();
+    pulses_.clear();
+    size_ = 0;
+    markers_ = 0;
+    lastMarker_ = 0;
+    last_ = 0;
+    overflowed_ = false;
+}
+
+bool ShapeTrace::assignEncoded(std::vector<uint8_t> samples, std::size_t sampleCount,
+                               std::vector<uint8_t> pulses, std::size_t pulseCount) {
+    clear();
+    // walk the data once to validate it and to restore the append state
+    std::size_t pos = 0;
+    int32_t value = 0;
+    for (std::size_t i = 0; i < sampleCount; ++i) {
+        uint32_t encoded;
+        if (!readVarint(samples, pos, encoded)) return false;
+        int32_t delta = unzigzag(encoded);
+        value = static_cast<int32_t>(static_cast<uint32_t>(value) + static_cast<uint32_t>(delta));
+    }
+    if (pos != samples.size()) return false;
+    pos = 0;
+    std::size_t marker = 0;
+    for (std::size_t i = 0; i < pulseCount; ++i) {
+        uint32_t gap;
+        if (!readVarint(pulses, pos, gap)) return false;
+        if (i > 0 && gap == 0) return false;
+        marker = i == 0 ? gap : marker + gap;
+    }
+    if (pos != pulses.size() || (pulseCount > 0 && marker >= sampleCount)) return false;
+
+    samples_ = std::move(samples);
+    pulses_ = std::move(pulses);
+    size_ = sampleCount;
+    markers_ = pulseCount;
+    lastMarker_ = marker;
+    last_ = value;
+    return true;
+}
+
+void ShapeTrace::decode(std::vector<int32_t>& values, std::vector<bool>* isPulse) const {
+    values.clear();
+    values.reserve(size_);
+    if (isPulse) {
+        isPulse->assign(size_, false);
+    }
+    Reader r(*this);
+    int32_t value;
+    bool pulse;
+    while (r.next(value, pulse)) {
+        if (isPulse && pulse) (*isPulse)[values.size()] = true;
+        values.push_back(value);
+    }
+}
+
+ShapeTrace::Reader::Reader(const ShapeTrace& trace)
+    : trace_(trace), samplePos_(0), markerPos_(0), index_(0), value_(0),
+      nextMarker_(0), hasMarker_(trace.markers_ > 0) {
+    if (hasMarker_) hasMarker_ = readMarkerGap();
+}
+
+bool ShapeTrace::Reader::next(int32_t& value, bool& isPulse) {
+    if (index_ >= trace_.size_) return false;
+    uint32_t encoded;
+    if (!readVarint(trace_.samples_, samplePos_, encoded)) {
+        index_ = trace_.size_; // corrupt, end here
+        return false;
+    }
+    int32_t delta = unzigzag(encoded);
+    value_ = static_cast<int32_t>(static_cast<uint32_t>(value_) + static_cast<uint32_t>(delta));
+    value = value_;
+    isPulse = hasMarker_ && nextMarker_ == index_;
+    if (isPulse) {
+        hasMarker_ = markerPos_ < trace_.pulses_.size() && readMarkerGap();
+    }
+    ++index_;
+    return true;
+}
+
+bool ShapeTrace::Reader::readMarkerGap() {
+    uint32_t gap;
+    if (!readVarint(trace_.pulses_, markerPos_, gap)) return false;
+    nextMarker_ += gap;
+    return true;
+}
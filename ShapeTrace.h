@@ -0,0 +1,131 @@
+#ifndef SHAPE_TRACE_H
+#define SHAPE_TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+* Compact storage for the full signal shape of a pump run.
+*
+* The capacitive signal changes slowly from sample to sample, so samples are
+* stored as zigzag varint deltas to the previous sample (one byte for
+* |delta| < 64). Pulse markers are sparse and stored as varint gaps between
+* the sample indices of consecutive pulses, instead of one flag per sample.
+*
+* The trace is append-only and decoded sequentially with a Reader.
+* Typical cost is a bit more than one byte per sample, compared to the
+* four bytes plus one bit of an int32_t vector and a std::vector<bool>.
+*/
+class ShapeTrace {
+public:
+    // Sequential decoder, stays valid as long as the trace is not modified
+    class Reader {
+    public:
+        explicit Reader(const ShapeTrace& trace);
+        // decodes the next sample, returns false at the end of the trace
+        // (or where the encoded data is corrupt)
+        bool next(int32_t& value, bool& isPulse);
+        bool next(int32_t& value) {
+            bool pulse;
+            return next(value, pulse);
+        }
+        // index of the sample returned by the next call to next()
+        std::size_t index() const { return index_; }
+
+    private:
+        // adds the next marker gap to nextMarker_, false if corrupt
+        bool readMarkerGap();
+
+        const ShapeTrace& trace_;
+        std::size_t samplePos_;
+        std::size_t markerPos_;
+        std::size_t index_;
+        int32_t value_;
+        std::size_t nextMarker_;
+        bool hasMarker_;
+    };
+
+    ShapeTrace() { clear(); }
+
+    void push_back(int32_t value);
+
+    // Marks sample index as a pulse. Markers must be added in increasing
+    // index order (they are, as pulses are found in time order); markers
+    // out of order or beyond the last sample are ignored and return false.
+    bool markPulse(std::size_t index);
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    std::size_t pulseCount() const { return markers_; }
+    // last appended sample
+    int32_t back() const { return last_; }
+
+    // Linear scan, use a Reader to walk the whole trace
+    bool isPulse(std::size_t index) const;
+
+    // reserves for the given number of samples and pulses
+    void reserve(std::size_t samples, std::size_t pulses = 0);
+    // clears the content, the reserved memory is kept
+    void clear();
+
+    // With a fixed capacity the buffers never grow beyond what was
+    // reserved: once full, the trace ignores further samples and markers
+    // and reports overflowed() until clear().
+    void setFixedCapacity(bool fixed) { fixed_ = fixed; }
+    bool fixedCapacity() const { return fixed_; }
+    bool overflowed() const { return overflowed_; }
+    // Reserved bytes, kept by clear(). A sample takes one byte for a delta
+    // in [-64, 63] and up to MaxVarintBytes otherwise, a marker one byte
+    // per 128 samples of gap; a fixed capacity trace stops MaxVarintBytes
+    // short of the end.
+    std::size_t sampleCapacityBytes() const { return samples_.capacity(); }
+    std::size_t markerCapacityBytes() const { return pulses_.capacity(); }
+    // average encoded size of the samples so far
+    float bytesPerSample() const {
+        return size_ > 0 ? static_cast<float>(samples_.size()) / size_ : 0;
+    }
+    static constexpr std::size_t MaxVarintBytes = 5;
+
+    // bytes held by the encoded buffers
+    std::size_t memoryUsage() const {
+        return samples_.capacity() + pulses_.capacity();
+    }
+
+    Reader reader() const { return Reader(*this); }
+    // decodes into plain vectors, for offline use
+    void decode(std::vector<int32_t>& values, std::vector<bool>* isPulse = nullptr) const;
+
+    // encoded data, e.g. for serialization
+    const std::vector<uint8_t>& encodedSamples() const { return samples_; }
+    const std::vector<uint8_t>& encodedPulses() const { return pulses_; }
+    // Replaces the trace with encoded data as returned by the two functions
+    // above. Returns false (and leaves the trace empty) if the data does not
+    // hold exactly the given number of samples and pulses.
+    bool assignEncoded(std::vector<uint8_t> samples, std::size_t sampleCount,
+                       std::vector<uint8_t> pulses, std::size_t pulseCount);
+
+    // varint helpers, shared with the serialization code
+    static void appendVarint(std::vector<uint8_t>& out, uint32_t v);
+    // reads at most MaxVarintBytes, false if the varint is truncated or
+    // longer (corrupt data)
+    static bool readVarint(const std::vector<uint8_t>& in, std::size_t& pos, uint32_t& value);
+    static uint32_t zigzag(int32_t v) {
+        return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+    }
+    static int32_t unzigzag(uint32_t v) {
+        return static_cast<int32_t>((v >> 1) ^ (~(v & 1) + 1));
+    }
+
+private:
+    std::vector<uint8_t> samples_;
+    std::vector<uint8_t> pulses_;
+    std::size_t size_;
+    std::size_t markers_;
+    std::size_t lastMarker_;
+    int32_t last_;
+    bool fixed_ = false;
+    bool overflowed_;
+};
+
+#endif // SHAPE_TRACE_H
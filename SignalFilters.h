@@ -0,0 +1,186 @@
+#ifndef SIGNAL_FILTERS_H
+#define SIGNAL_FILTERS_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/*
+* Integer signal conditioning between touchRead and the pulse detector.
+*
+* Filters are composed at compile time, e.g.
+*
+*   using Conditioning = FilterChain<MedianFilter<3>, LowPassFilter<1>>;
+*   MonitoredPump<3, PulseExtremaDetector<int32_t,3>, Conditioning> pump(...);
+*
+* so the whole chain inlines into one step per sample, without virtual
+* calls or heap. Cleaner input lets the detector work with a shorter
+* Lookahead, i.e. less latency and fewer compares per sample.
+*
+* A filter has
+*   bool    process(int32_t in, int32_t& out)  false if it has no output
+*                                              for this input (decimation)
+*   void    reset(int32_t level)               state as after a long flat
+*                                              input at level
+*   int32_t steadyOutput(int32_t level) const  output for a flat input
+*   static constexpr std::size_t Decimation    inputs per output
+*
+* Filters delay the signal (the median by (N-1)/2 samples, the low-pass
+* by about 2^Shift samples), which shifts the pulse times by a constant.
+* Pulse intervals are not affected, and the predictive stop learns the
+* shift with its stop offset.
+*/
+
+// median of the last N samples, removes single sample spikes (N=3) or
+// up to (N-1)/2 consecutive ones
+template<std::size_t N>
+class MedianFilter {
+public:
+    static_assert(N % 2 == 1 && N <= 15, "N must be odd and small");
+    static constexpr std::size_t Decimation = 1;
+
+    MedianFilter() { reset(0); }
+
+    bool process(int32_t in, int32_t& out) {
+        window_[pos_] = in;
+        if (++pos_ == N) pos_ = 0;
+        // insertion sort of a copy, cheap for the small N used here
+        std::array<int32_t, N> sorted;
+        for (std::size_t i = 0; i < N; ++i) {
+            const int32_t v = window_[i];
+            std::size_t j = i;
+            for (; j > 0 && sorted[j - 1] > v; --j) sorted[j] = sorted[j - 1];
+            sorted[j] = v;
+        }
+        out = sorted[N / 2];
+        return true;
+    }
+    void reset(int32_t level) {
+        window_.fill(level);
+        pos_ = 0;
+    }
+    int32_t steadyOutput(int32_t level) const { return level; }
+
+private:
+    std::array<int32_t, N> window_;
+    std::size_t pos_;
+};
+
+// first order IIR low-pass y += (x - y) / 2^Shift, with Shift fraction
+// bits of state so small steps are not lost. Inputs must stay below
+// 2^(31-Shift), touch values are 16 bit.
+template<unsigned Shift>
+class LowPassFilter {
+public:
+    static_assert(Shift > 0 && Shift < 16, "Shift out of range");
+    static constexpr std::size_t Decimation = 1;
+
+    LowPassFilter() { reset(0); }
+
+    bool process(int32_t in, int32_t& out) {
+        state_ += in - (state_ >> Shift);
+        out = state_ >> Shift;
+        return true;
+    }
+    void reset(int32_t level) { state_ = level * (int32_t(1) << Shift); }
+    int32_t steadyOutput(int32_t level) const { return level; }
+
+private:
+    int32_t state_;
+};
+
+// mean of each block of N samples, one output per block. The detector
+// then runs at 1/N of the sample rate, MonitoredPump scales its sample
+// counts accordingly.
+template<std::size_t N>
+class DecimateFilter {
+public:
+    static_assert(N > 0, "N must be at least 1");
+    static constexpr std::size_t Decimation = N;
+
+    DecimateFilter() { reset(0); }
+
+    bool process(int32_t in, int32_t& out) {
+        sum_ += in;
+        if (++count_ < N) return false;
+        out = sum_ / static_cast<int32_t>(N);
+        sum_ = 0;
+        count_ = 0;
+        return true;
+    }
+    void reset(int32_t) {
+        sum_ = 0;
+        count_ = 0;
+    }
+    int32_t steadyOutput(int32_t level) const { return level; }
+
+private:
+    int32_t sum_;
+    std::size_t count_;
+};
+
+// Removes the slowly moving level (a low-pass with a long time constant of
+// about 2^Shift samples), the output swings around zero. Keep Shift well
+// above the samples per pulse, or the pulses are removed too.
+template<unsigned Shift>
+class DcBlockFilter {
+public:
+    static_assert(Shift > 0 && Shift < 16, "Shift out of range");
+    static constexpr std::size_t Decimation = 1;
+
+    DcBlockFilter() { reset(0); }
+
+    bool process(int32_t in, int32_t& out) {
+        level_ += in - (level_ >> Shift);
+        out = in - (level_ >> Shift);
+        return true;
+    }
+    void reset(int32_t level) { level_ = level * (int32_t(1) << Shift); }
+    int32_t steadyOutput(int32_t) const { return 0; }
+
+private:
+    int32_t level_;
+};
+
+// Runs the filters in order. An empty chain (NoFilter) passes the samples
+// through unchanged and compiles to nothing.
+template<typename... Filters>
+class FilterChain;
+
+template<>
+class FilterChain<> {
+public:
+    static constexpr std::size_t Decimation = 1;
+    bool process(int32_t in, int32_t& out) {
+        out = in;
+        return true;
+    }
+    void reset(int32_t) {}
+    int32_t steadyOutput(int32_t level) const { return level; }
+};
+
+template<typename First, typename... Rest>
+class FilterChain<First, Rest...> {
+public:
+    static constexpr std::size_t Decimation = First::Decimation * FilterChain<Rest...>::Decimation;
+
+    bool process(int32_t in, int32_t& out) {
+        int32_t next;
+        return first_.process(in, next) && rest_.process(next, out);
+    }
+    void reset(int32_t level) {
+        first_.reset(level);
+        rest_.reset(first_.steadyOutput(level));
+    }
+    int32_t steadyOutput(int32_t level) const {
+        return rest_.steadyOutput(first_.steadyOutput(level));
+    }
+
+private:
+    First first_;
+    FilterChain<Rest...> rest_;
+};
+
+using NoFilter = FilterChain<>;
+
+#endif // SIGNAL_FILTERS_H
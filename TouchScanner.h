@@ -0,0 +1,105 @@
+#ifndef TOUCH_SCANNER_H
+#define TOUCH_SCANNER_H
+
+#include "PumpHal.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// values of all pads of a TouchScanner from one sweep
+template<std::size_t MaxPads>
+struct TouchFrame {
+    unsigned long timeUs = 0;   // micros() when the sweep was read
+    uint32_t sequence = 0;      // counts the fresh frames, to spot a skipped tick
+    bool fresh = false;         // false: the last scan() came too early or failed, values and time are older
+    uint32_t lockWaitUs = 0;    // time the read waited for the touch lock
+    std::size_t count = 0;
+    std::array<uint32_t, MaxPads> values{};
+};
+
+template<std::size_t MaxPads>
+class TouchScanner {
+    /*
+    * Reads the touch pads of many pumps in one go.
+    * touchRead measures one pad per call and blocks for the whole
+    * measurement (about 1.5 ms with configureTouch) behind a global lock,
+    * so reading pad after pad takes longer with every pump. The scanner
+    * instead puts all pads into the sweep of the touch FSM, which measures
+    * them in the background, and scan() fetches the latest value of every
+    * pad at once as a timestamped frame. The pumps then take their samples
+    * from the frame (see PumpScheduler).
+    *
+    * The values of a frame are the last complete measurement of each pad,
+    * i.e. up to one sweep old. All pads share the frame time.
+    *
+    * A sweep over many pads can take longer than the scan interval. A
+    * scan() less than one sweep (pumphal::touchSweepUs) after the last
+    * read could return values the FSM has not measured again yet, so it
+    * does not read: the frame keeps its values and time and is marked not
+    * fresh. Users must skip frames that are not fresh instead of taking
+    * the same values again as new samples. A sweep that could not be read
+    * (pumphal::touchReadAll failed) leaves the frame not fresh as well, and
+    * the next scan() tries again.
+    */
+public:
+    using Frame = TouchFrame<MaxPads>;
+
+    // adds the pad of pin to the sweep and returns its index in the
+    // frame; a pin added before keeps its index. -1 if full or no touch pin.
+    int addPad(uint8_t pin) {
+        for (std::size_t i = 0; i < count_; ++i) {
+            if (pins_[i] == pin) return static_cast<int>(i);
+        }
+        if (count_ >= MaxPads || !pumphal::addTouchPad(pin)) return -1;
+        pins_[count_] = pin;
+        sweepUs_ = pumphal::touchSweepUs(count_ + 1);
+        return static_cast<int>(count_++);
+    }
+
+    std::size_t size() const { return count_; }
+
+    // reads all pads if a sweep has passed since the last read, the result
+    // stays in frame() until the next scan
+    const Frame& scan() {
+        const unsigned long now = pumphal::micros();
+        if (frame_.sequence > 0 && frame_.count == count_ && now - frame_.timeUs < sweepUs_) {
+            frame_.fresh = false;
+            ++staleScans_;
+            return frame_;
+        }
+        //read aside, a failed read must not change the frame
+        std::array<uint32_t, MaxPads> values;
+        uint32_t lockWaitUs = 0;
+        if (!pumphal::touchReadAll(pins_.data(), count_, values.data(), &lockWaitUs)) {
+            frame_.fresh = false;
+            ++failedScans_;
+            return frame_;
+        }
+        frame_.timeUs = now;
+        frame_.values = values;
+        frame_.lockWaitUs = lockWaitUs;
+        frame_.count = count_;
+        frame_.fresh = true;
+        ++frame_.sequence;
+        return frame_;
+    }
+
+    const Frame& frame() const { return frame_; }
+
+    // duration of one sweep over all pads
+    uint32_t sweepUs() const { return sweepUs_; }
+    // scans that came too early and did not read
+    uint32_t staleScans() const { return staleScans_; }
+    // scans whose read failed
+    uint32_t failedScans() const { return failedScans_; }
+
+private:
+    std::array<uint8_t, MaxPads> pins_{};
+    std::size_t count_ = 0;
+    uint32_t sweepUs_ = 0;
+    uint32_t staleScans_ = 0;
+    uint32_t failedScans_ = 0;
+    Frame frame_;
+};
+
+#endif // TOUCH_SCANNER_H
@@ -0,0 +1,335 @@
+// Host benchmark for the detectors, buffers and diagnostics.
+//
+//   g++ -std=c++17 -O2 -I.. benchmark.cpp ../HostHal.cpp ../MonitoredPump.cpp ../ShapeTrace.cpp -lpthread -o benchmark
+//   ./benchmark [--quick] > results.json
+//
+// Add -DPUMP_INSTRUMENTATION to measure the cost of the loop counters.
+//
+// Prints one JSON document to stdout (a human readable table goes to
+// stderr), so results of two releases can be diffed or compared by a script.
+// Every entry has the benchmark name, its parameters, the best time per
+// operation out of several repetitions, the throughput, and the heap use:
+// bytes still allocated after the run and the peak during it.
+
+#include "../PulseLookaheadDetector.h"
+#include "../PulseExtremaDetector.h"
+#include "../AdaptivePulseDetector.h"
+#include "../RingBuffer.h"
+#include "../MonitoredPump.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+// ---- heap accounting ------------------------------------------------------
+
+namespace {
+
+struct HeapCounters {
+    std::size_t current = 0;
+    std::size_t peak = 0;
+    std::size_t allocations = 0;
+};
+HeapCounters heap;
+
+// the size is kept in front of each block
+constexpr std::size_t kHeader = alignof(std::max_align_t);
+
+void* countedAlloc(std::size_t size) {
+    void* p = std::malloc(size + kHeader);
+    if (!p) throw std::bad_alloc();
+    *static_cast<std::size_t*>(p) = size;
+    heap.current += size;
+    ++heap.allocations;
+    if (heap.current > heap.peak) heap.peak = heap.current;
+    return static_cast<char*>(p) + kHeader;
+}
+
+void countedFree(void* p) {
+    if (!p) return;
+    void* block = static_cast<char*>(p) - kHeader;
+    heap.current -= *static_cast<std::size_t*>(block);
+    std::free(block);
+}
+
+} // namespace
+
+void* operator new(std::size_t size) { return countedAlloc(size); }
+void* operator new[](std::size_t size) { return countedAlloc(size); }
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, std::size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, std::size_t) noexcept { countedFree(p); }
+
+namespace {
+
+// ---- signals --------------------------------------------------------------
+
+using Signal = std::vector<int32_t>;
+
+// pump-like signal: baseline 500, amplitude 20, 20 samples per pulse
+Signal makeSignal(const std::string& shape, std::size_t n) {
+    std::mt19937 rng(12345);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::uniform_int_distribution<int32_t> uniform(450, 550);
+    Signal s(n);
+    const float pi = 3.14159265f;
+    for (std::size_t i = 0; i < n; ++i) {
+        float phase = pi * static_cast<float>(i) / 20.0f;
+        float v = 500;
+        if (shape == "sine") v += 20 * std::cos(phase);
+        else if (shape == "noisy") v += 20 * std::cos(phase) + 2 * noise(rng);
+        else if (shape == "flat") v += 0;
+        else if (shape == "random") v = static_cast<float>(uniform(rng));
+        else if (shape == "ramp") v += static_cast<float>(i % 1000);
+        s[i] = static_cast<int32_t>(std::lround(v));
+    }
+    return s;
+}
+
+const char* kShapes[] = {"sine", "noisy", "flat", "random", "ramp"};
+
+// ---- measurement ----------------------------------------------------------
+
+struct Result {
+    std::string name;
+    std::string params;   // JSON object members, without braces
+    double nsPerOp;
+    double opsPerSecond;
+    std::size_t heapBytes;
+    std::size_t heapPeak;
+    std::size_t allocations;
+    double extra;         // benchmark specific, see extraName
+    const char* extraName;
+};
+
+std::vector<Result> results;
+int repetitions = 5;
+volatile uint64_t sink; // keeps results alive
+
+// Runs body() `repetitions` times and keeps the fastest. body returns the
+// number of operations it did. Heap numbers are from the last repetition.
+template<typename Body>
+Result measure(const std::string& name, const std::string& params, Body body) {
+    Result r{name, params, 0, 0, 0, 0, 0, 0, nullptr};
+    double best = 1e300;
+    for (int rep = 0; rep < repetitions; ++rep) {
+        const std::size_t before = heap.current;
+        heap.peak = heap.current;
+        const std::size_t allocations = heap.allocations;
+        auto start = std::chrono::steady_clock::now();
+        std::size_t ops = body();
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (ops > 0 && ns / ops < best) best = ns / ops;
+        r.heapBytes = heap.current - before;
+        r.heapPeak = heap.peak - before;
+        r.allocations = heap.allocations - allocations;
+    }
+    r.nsPerOp = best;
+    r.opsPerSecond = best > 0 ? 1e9 / best : 0;
+    std::fprintf(stderr, "%-26s %-62s %9.2f ns/op %12zu B peak\n", name.c_str(),
+                 params.c_str(), r.nsPerOp, r.heapPeak);
+    results.push_back(r);
+    return r;
+}
+
+std::string param(const char* key, const std::string& value) {
+    return std::string("\"") + key + "\": \"" + value + "\"";
+}
+std::string param(const char* key, std::size_t value) {
+    return std::string("\"") + key + "\": " + std::to_string(value);
+}
+
+// ---- benchmarks -----------------------------------------------------------
+
+template<std::size_t L>
+void detectors(const Signal& signal, const std::string& shape) {
+    const std::string p = param("lookahead", L) + ", " + param("signal", shape);
+    measure("detector.lookahead_pair", p, [&] {
+        // the original peak + trough setup: two detectors, one inverted
+        PulseLookaheadDetector<int32_t, L> peaks(false);
+        PulseLookaheadDetector<int32_t, L> troughs(true);
+        uint64_t hits = 0;
+        for (int32_t v : signal) hits += peaks.addSample(v) + troughs.addSample(v);
+        sink = hits;
+        return signal.size();
+    });
+    measure("detector.extrema", p, [&] {
+        PulseExtremaDetector<int32_t, L> d;
+        uint64_t hits = 0;
+        for (int32_t v : signal) hits += d.addSample(v) != PulseType::None;
+        sink = hits;
+        return signal.size();
+    });
+    measure("detector.adaptive", p, [&] {
+        AdaptivePulseDetector<int32_t, 32> d;
+        d.setLookahead(L);
+        uint64_t hits = 0;
+        for (int32_t v : signal) hits += d.addSample(v) != PulseType::None;
+        sink = hits;
+        return signal.size();
+    });
+}
+
+template<std::size_t Capacity>
+void ringBuffer(std::size_t n) {
+    const std::string p = param("capacity", Capacity);
+    measure("ringbuffer.push_back", p, [&] {
+        RingBuffer<int32_t, Capacity> rb;
+        for (std::size_t i = 0; i < n; ++i) rb.push_back(static_cast<int32_t>(i));
+        sink = rb.back();
+        return n;
+    });
+    measure("ringbuffer.scan", p, [&] {
+        // what the lookahead detector does per sample: one full scan
+        RingBuffer<int32_t, Capacity> rb;
+        for (std::size_t i = 0; i < Capacity; ++i) rb.push_back(static_cast<int32_t>(i));
+        uint64_t sum = 0;
+        for (std::size_t i = 0; i < n / Capacity; ++i) {
+            for (std::size_t j = 0; j < Capacity; ++j) sum += rb[j];
+        }
+        sink = sum;
+        return (n / Capacity) * Capacity;
+    });
+}
+
+void diagnostics(std::size_t pulses) {
+    for (int history = 0; history < 2; ++history) {
+        const std::string p = param("pulses", pulses) + ", " + param("history", history ? "on" : "off");
+        measure("diagnostics.add_pulse", p, [&] {
+            PumpDiagnostics d;
+            d.setKeepHistory(history != 0);
+            unsigned long t = 0;
+            for (std::size_t i = 0; i < pulses; ++i) {
+                t += 20000 + (i % 7) * 100;
+                d.addPulse(t, (i & 1) ? 520.0f : 480.0f);
+            }
+            sink = d.pulseCount();
+            return pulses;
+        });
+    }
+    const std::string p = param("pulses", pulses);
+    measure("diagnostics.recompute", p, [&] {
+        PumpDiagnostics d;
+        d.setKeepHistory(true);
+        for (std::size_t i = 0; i < pulses; ++i) d.addPulse(i * 20000, (i & 1) ? 520.0f : 480.0f);
+        d.recomputeStatistics();
+        sink = d.pulseCount();
+        return pulses;
+    });
+}
+
+void shapeTrace(const Signal& signal, const std::string& shape) {
+    const std::string p = param("samples", signal.size()) + ", " + param("signal", shape);
+    ShapeTrace kept;
+    measure("shapetrace.push_back", p, [&] {
+        ShapeTrace t;
+        for (std::size_t i = 0; i < signal.size(); ++i) {
+            t.push_back(signal[i]);
+            if (i % 20 == 0) t.markPulse(i);
+        }
+        sink = t.size();
+        kept = t;
+        return signal.size();
+    });
+    results.back().extra = static_cast<double>(kept.memoryUsage()) / signal.size();
+    results.back().extraName = "bytes_per_sample";
+    measure("shapetrace.decode", p, [&] {
+        ShapeTrace::Reader reader = kept.reader();
+        int32_t value;
+        bool pulse;
+        uint64_t sum = 0;
+        while (reader.next(value, pulse)) sum += value + pulse;
+        sink = sum;
+        return signal.size();
+    });
+}
+
+// the whole per-sample path of a run: filters, detector, timestamps,
+// statistics, trace
+template<std::size_t L, typename Filter = NoFilter>
+void processSample(const Signal& signal, bool full, const char* filter = "none") {
+    const std::string p = param("lookahead", L) + ", " + param("samples", signal.size()) + ", " +
+                          param("full_diagnostics", full ? "on" : "off") + ", " + param("filter", filter);
+    measure("pump.process_sample", p, [&] {
+        MonitoredPump<L, PulseExtremaDetector<int32_t, L>, Filter> pump(1, 2, 10.0f, 20);
+        pump.beginRun(UINT32_MAX, full, 2000);
+        unsigned long t = 0;
+        for (int32_t v : signal) {
+            pump.processSample(static_cast<uint32_t>(v), t);
+            t += 2000;
+        }
+        pump.endRun(RunResult::Aborted);
+        sink = pump.getDiagnostics().pulseCount();
+        return signal.size();
+    });
+}
+
+void printJson() {
+    std::printf("{\n  \"format\": 1,\n  \"benchmarks\": [\n");
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        std::printf("    {\"name\": \"%s\", \"params\": {%s}, \"ns_per_op\": %.3f, "
+                    "\"ops_per_second\": %.0f, \"heap_bytes\": %zu, \"heap_peak_bytes\": %zu, "
+                    "\"allocations\": %zu",
+                    r.name.c_str(), r.params.c_str(), r.nsPerOp, r.opsPerSecond,
+                    r.heapBytes, r.heapPeak, r.allocations);
+        if (r.extraName) std::printf(", \"%s\": %.3f", r.extraName, r.extra);
+        std::printf("}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n}\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bool quick = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else {
+            std::fprintf(stderr, "%s: unknown argument %s\nusage: %s [--quick]\n", argv[0], argv[i], argv[0]);
+            return 2;
+        }
+    }
+    if (quick) repetitions = 2;
+    const std::size_t samples = quick ? 100000 : 1000000;
+
+    for (const char* shape : kShapes) {
+        Signal signal = makeSignal(shape, samples);
+        detectors<2>(signal, shape);
+        detectors<5>(signal, shape);
+        detectors<10>(signal, shape);
+        detectors<20>(signal, shape);
+    }
+
+    ringBuffer<5>(samples);
+    ringBuffer<11>(samples);
+    ringBuffer<41>(samples);
+
+    for (std::size_t pulses : {std::size_t(1000), std::size_t(100000), samples}) {
+        diagnostics(pulses);
+    }
+
+    for (const char* shape : {"noisy", "random"}) {
+        shapeTrace(makeSignal(shape, samples), shape);
+    }
+
+    for (std::size_t n : {samples / 100, samples / 10, samples}) {
+        Signal signal = makeSignal("noisy", n);
+        processSample<5>(signal, false);
+        processSample<5>(signal, true);
+        processSample<20>(signal, false);
+        processSample<2, FilterChain<MedianFilter<3>, LowPassFilter<1>>>(signal, false, "median3,lowpass1");
+    }
+
+    printJson();
+    return 0;
+}
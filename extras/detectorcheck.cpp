@@ -0,0 +1,233 @@
+// Checks that PulseExtremaDetector (and AdaptivePulseDetector at the same
+// lookahead) find exactly the peaks and troughs of a PulseLookaheadDetector
+// pair, the detector the fused one replaces.
+//
+//   g++ -std=c++17 -O2 -I.. detectorcheck.cpp ../HostHal.cpp ../MonitoredPump.cpp ../ShapeTrace.cpp -lpthread -o detectorcheck
+//   ./detectorcheck [--wrap] [trace...]
+//
+// Every signal is run through all three detectors at each lookahead from 1
+// to MaxLookahead (20), and the outputs are compared sample by sample: same sample, same type.
+// Signals are generated ones (clean and noisy sines, plateaus with ties,
+// small random integers with many ties, a ramp) plus the full shapes of
+// the diagnostics files given (DiagnosticsFormat.h, records without a full
+// shape are skipped).
+//
+// --wrap also runs past 2^32 samples, where the sample index wraps around,
+// and checks that the detection goes on without a gap (takes a while).
+//
+// Prints one line per signal and lookahead, exits with 1 on any mismatch.
+
+#include "../DiagnosticsFormat.h"
+#include "../PulseLookaheadDetector.h"
+#include "../PulseExtremaDetector.h"
+#include "../AdaptivePulseDetector.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr std::size_t MaxLookahead = 20;
+
+struct Signal {
+    std::string name;
+    std::vector<int32_t> values;
+};
+
+// ---- signals --------------------------------------------------------------
+
+std::vector<Signal> generated() {
+    std::vector<Signal> signals;
+    std::mt19937 rng(42);
+    const std::size_t n = 20000;
+
+    Signal sine{"sine", {}};
+    Signal noisy{"noisy", {}};
+    std::normal_distribution<float> noise(0, 3);
+    for (std::size_t i = 0; i < n; ++i) {
+        const float v = 500 + 40 * std::sin(i * 2 * 3.14159265f / 18);
+        sine.values.push_back(static_cast<int32_t>(std::lround(v)));
+        noisy.values.push_back(static_cast<int32_t>(std::lround(v + noise(rng))));
+    }
+    signals.push_back(sine);
+    signals.push_back(noisy);
+
+    // flat tops and bottoms, the tie rules decide which sample is the pulse
+    Signal plateaus{"plateaus", {}};
+    for (std::size_t i = 0; i < n; ++i) {
+        plateaus.values.push_back((i / 7) % 2 ? 520 : 480);
+    }
+    signals.push_back(plateaus);
+
+    Signal random{"random", {}};
+    std::uniform_int_distribution<int32_t> level(0, 3);
+    for (std::size_t i = 0; i < n; ++i) random.values.push_back(level(rng));
+    signals.push_back(random);
+
+    Signal ramp{"ramp", {}};
+    for (std::size_t i = 0; i < n; ++i) ramp.values.push_back(static_cast<int32_t>(i % 1000));
+    signals.push_back(ramp);
+    return signals;
+}
+
+class FileSource {
+public:
+    explicit FileSource(FILE* f) : f_(f) {}
+    bool read(uint8_t* data, std::size_t size) {
+        return std::fread(data, 1, size, f_) == size;
+    }
+    bool atEnd() {
+        int c = std::fgetc(f_);
+        if (c == EOF) return true;
+        std::ungetc(c, f_);
+        return false;
+    }
+private:
+    FILE* f_;
+};
+
+bool load(const char* path, std::vector<Signal>& signals) {
+    FILE* f = std::fopen(path, "rb");
+    if (!f) {
+        std::fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    FileSource source(f);
+    diagformat::Reader<FileSource> reader(source);
+    diagformat::Record r;
+    int index = 0;
+    bool ok = true;
+    while (!source.atEnd()) {
+        if (reader.read(r) != diagformat::Error::None) {
+            std::fprintf(stderr, "%s: record %d unreadable\n", path, index);
+            ok = false;
+            break;
+        }
+        if (!r.fullShape.empty()) {
+            Signal s{std::string(path) + "#" + std::to_string(index), {}};
+            r.fullShape.decode(s.values);
+            signals.push_back(std::move(s));
+        }
+        ++index;
+    }
+    std::fclose(f);
+    return ok;
+}
+
+// ---- comparison -----------------------------------------------------------
+
+template<std::size_t L>
+struct Pair {
+    PulseLookaheadDetector<int32_t, L> peaks{false};
+    PulseLookaheadDetector<int32_t, L> troughs{true};
+    // both at once would be a bug of the reference, report it as a mismatch
+    int add(int32_t v) {
+        const bool peak = peaks.addSample(v);
+        const bool trough = troughs.addSample(v);
+        if (peak && trough) return -1;
+        return static_cast<int>(peak ? PulseType::Peak : trough ? PulseType::Trough : PulseType::None);
+    }
+};
+
+struct Counts {
+    std::size_t pulses = 0;
+    std::size_t extremaMismatches = 0;
+    std::size_t adaptiveMismatches = 0;
+};
+
+template<std::size_t L>
+Counts compare(const std::vector<int32_t>& values) {
+    Pair<L> pair;
+    PulseExtremaDetector<int32_t, L> extrema;
+    AdaptivePulseDetector<int32_t, MaxLookahead> adaptive;
+    adaptive.setLookahead(L);
+    Counts c;
+    for (int32_t v : values) {
+        const int expected = pair.add(v);
+        if (expected > 0) ++c.pulses;
+        if (static_cast<int>(extrema.addSample(v)) != expected) ++c.extremaMismatches;
+        if (static_cast<int>(adaptive.addSample(v)) != expected) ++c.adaptiveMismatches;
+    }
+    return c;
+}
+
+bool report(const std::string& name, std::size_t lookahead, const Counts& c) {
+    const bool ok = c.extremaMismatches == 0 && c.adaptiveMismatches == 0;
+    std::printf("%-24s lookahead %2zu  pulses %6zu  mismatches extrema %zu adaptive %zu  %s\n",
+                name.c_str(), lookahead, c.pulses, c.extremaMismatches, c.adaptiveMismatches,
+                ok ? "ok" : "FAILED");
+    return ok;
+}
+
+template<std::size_t L>
+bool checkAll(const std::vector<Signal>& signals) {
+    bool ok = true;
+    for (const Signal& s : signals) {
+        ok &= report(s.name, L, compare<L>(s.values));
+    }
+    return ok;
+}
+
+// lookahead 1 to sizeof...(L)
+template<std::size_t... L>
+bool checkLookaheads(const std::vector<Signal>& signals, std::index_sequence<L...>) {
+    bool ok = true;
+    ((ok &= checkAll<L + 1>(signals)), ...);
+    return ok;
+}
+
+// Runs a periodic signal past the 2^32 wrap of the sample index. The pair
+// only sees the last period before and the samples after the wrap, which
+// is enough for its window.
+bool checkWrap() {
+    constexpr std::size_t L = 3;
+    constexpr uint32_t Period = 16;
+    auto value = [](uint64_t i) { return static_cast<int32_t>((i % Period) < Period / 2 ? i % Period : Period - i % Period); };
+    PulseExtremaDetector<int32_t, L> extrema;
+    AdaptivePulseDetector<int32_t, MaxLookahead> adaptive;
+    adaptive.setLookahead(L);
+    const uint64_t wrap = uint64_t(1) << 32;
+    const uint64_t start = wrap - 4 * Period;
+    for (uint64_t i = 0; i < start; ++i) {
+        extrema.addSample(value(i));
+        adaptive.addSample(value(i));
+    }
+    Pair<L> pair;
+    Counts c;
+    // the pair needs a full window before it reports, skip that part
+    for (uint64_t i = start; i < wrap + 8 * Period; ++i) {
+        const int32_t v = value(i);
+        const int expected = pair.add(v);
+        const int e = static_cast<int>(extrema.addSample(v));
+        const int a = static_cast<int>(adaptive.addSample(v));
+        if (i < start + 2 * L) continue;
+        if (expected > 0) ++c.pulses;
+        if (e != expected) ++c.extremaMismatches;
+        if (a != expected) ++c.adaptiveMismatches;
+    }
+    return report("wrap", L, c);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bool wrap = false;
+    std::vector<Signal> signals = generated();
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--wrap") == 0) {
+            wrap = true;
+        } else if (!load(argv[i], signals)) {
+            return 2;
+        }
+    }
+    bool ok = true;
+    ok &= checkLookaheads(signals, std::make_index_sequence<MaxLookahead>());
+    if (wrap) ok &= checkWrap();
+    std::printf("%s\n", ok ? "all equal" : "MISMATCH");
+    return ok ? 0 : 1;
+}
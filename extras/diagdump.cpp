@@ -0,0 +1,111 @@
+// Host decoder for diagnostics written with DiagnosticsFormat.h
+//
+//   g++ -std=c++17 -O2 -I.. diagdump.cpp ../HostHal.cpp ../MonitoredPump.cpp ../ShapeTrace.cpp -o diagdump
+//   ./diagdump dump.bin            summary of every record in the file
+//   ./diagdump dump.bin --pulses   plus one "time,value" line per pulse
+//   ./diagdump dump.bin --shape    plus one "sample,value,pulse" line per sample
+//
+// A file may hold several records back to back, e.g. one per run.
+
+#include "../DiagnosticsFormat.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+class FileSource {
+public:
+    explicit FileSource(FILE* f) : f_(f) {}
+    bool read(uint8_t* data, std::size_t size) {
+        return std::fread(data, 1, size, f_) == size;
+    }
+    bool atEnd() {
+        int c = std::fgetc(f_);
+        if (c == EOF) return true;
+        std::ungetc(c, f_);
+        return false;
+    }
+private:
+    FILE* f_;
+};
+
+const char* errorName(diagformat::Error e) {
+    switch (e) {
+        case diagformat::Error::None: return "ok";
+        case diagformat::Error::Truncated: return "truncated";
+        case diagformat::Error::BadMagic: return "bad magic";
+        case diagformat::Error::BadVersion: return "unsupported version";
+        case diagformat::Error::BadData: return "inconsistent data";
+        case diagformat::Error::BadCrc: return "crc mismatch";
+    }
+    return "unknown";
+}
+
+void printStats(const char* name, const RunningStats& s) {
+    std::printf("%s: n=%u mean=%.2f dev=%.2f min=%.2f max=%.2f\n", name, s.count(),
+                s.mean(), s.deviation(), s.lowest(), s.highest());
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s file [--pulses] [--shape]\n", argv[0]);
+        return 2;
+    }
+    bool pulses = false;
+    bool shape = false;
+    for (int i = 2; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--pulses") == 0) pulses = true;
+        if (std::strcmp(argv[i], "--shape") == 0) shape = true;
+    }
+    FILE* f = std::fopen(argv[1], "rb");
+    if (!f) {
+        std::perror(argv[1]);
+        return 1;
+    }
+    FileSource source(f);
+    diagformat::Reader<FileSource> reader(source);
+    diagformat::Record r;
+    int records = 0;
+    int status = 0;
+    while (!source.atEnd()) {
+        diagformat::Error e = reader.read(r);
+        if (e != diagformat::Error::None) {
+            std::fprintf(stderr, "record %d: %s\n", records, errorName(e));
+            status = 1;
+            break;
+        }
+        std::printf("# record %d (version %u)\n", records, r.version);
+        std::printf("pulses: %u, missed samples: %u, baseline: %lu\n", r.pulseCount,
+                    r.missedSamples, r.baseline);
+        printStats("interval us", r.intervalStats);
+        printStats("amplitude", r.amplitudeStats);
+        std::printf("histogram (bin %u us):", r.intervalHistogram.binWidth());
+        for (uint32_t c : r.intervalHistogram.counts()) std::printf(" %u", c);
+        std::printf("\n");
+        if (r.predictedStop) {
+            std::printf("predicted stop: error %d us%s\n", r.stopErrorUs,
+                        r.lastPulseMissed ? " (last pulse missed)" : "");
+        }
+        if (pulses) {
+            std::printf("time,value\n");
+            for (std::size_t i = 0; i < r.pulseTimes.size(); ++i) {
+                std::printf("%lu,%.2f\n", r.pulseTimes[i], r.valuesAtPulses[i]);
+            }
+        }
+        if (shape) {
+            std::printf("sample,value,pulse\n");
+            ShapeTrace::Reader trace = r.fullShape.reader();
+            int32_t value;
+            bool isPulse;
+            while (trace.next(value, isPulse)) {
+                std::printf("%zu,%d,%d\n", trace.index() - 1, value, isPulse ? 1 : 0);
+            }
+        }
+        ++records;
+    }
+    std::fclose(f);
+    return status;
+}
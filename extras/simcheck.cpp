@@ -0,0 +1,351 @@
+// Runs the pump classes against SimulatedPump on the host backend and
+// checks that every run detects exactly the pulses the simulated pump
+// delivered, and ends with the expected result: MonitoredPump from a cold
+// and a warm start, with predictive stop, AsyncMonitoredPump (also stopped mid-run),
+// PumpScheduler, DosingQueue, and the interrupt driven Pump and FlowMeter.
+//
+//   g++ -std=c++17 -O2 -I.. simcheck.cpp ../HostHal.cpp ../PumpSimulator.cpp ../MonitoredPump.cpp ../ShapeTrace.cpp ../Pump.cpp ../FlowMeter.cpp -lpthread -o simcheck
+//   ./simcheck
+//
+// Prints one line per case, exits with 1 on any failure.
+
+#include "../AsyncMonitoredPump.h"
+#include "../DosingQueue.h"
+#include "../FlowMeter.h"
+#include "../MonitoredPump.h"
+#include "../Pump.h"
+#include "../PumpScheduler.h"
+#include "../PumpSimulator.h"
+
+#include <cstdio>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+bool report(const std::string& name, bool ok, const std::string& detail) {
+    std::printf("%-48s %s  %s\n", name.c_str(), detail.c_str(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+std::string counts(RunResult result, uint32_t detected, uint64_t delivered) {
+    return "result " + std::to_string(static_cast<int>(result)) + " detected " + std::to_string(detected) +
+           " delivered " + std::to_string(delivered);
+}
+
+// ---- warm-up --------------------------------------------------------------
+
+constexpr uint32_t SamplePeriodUs = MonitoredPump<1>::SampleIntervalMs * 1000;
+
+SimulatedPumpConfig simConfig(float periodUs, float noise, uint8_t pin = 1) {
+    SimulatedPumpConfig c;
+    c.enablePin = pin;
+    c.touchPin = static_cast<uint8_t>(20 + pin);
+    c.periodUs = periodUs;
+    c.noise = noise;
+    return c;
+}
+
+// Consecutive runs of one pump: the first starts at rest on an extremum of
+// the signal, the later ones where the last run stopped. No run may report
+// a pulse before the pump has delivered it, nor miss the first one.
+template<typename Pump>
+bool checkRuns(const std::string& name, float periodUs, float noise, uint32_t pulses) {
+    const SimulatedPumpConfig c = simConfig(periodUs, noise);
+    SimulatedPump sim(c);
+    Pump pump(c.enablePin, c.touchPin, 10.f, static_cast<uint32_t>(periodUs / 2 / SamplePeriodUs));
+    pump.begin();
+    bool ok = true;
+    for (int run = 0; run < 3; ++run) {
+        sim.resetPulses();
+        pump.runForPulses(pulses);
+        const uint32_t detected = pump.getDiagnostics().pulseCount();
+        const bool good = pump.lastResult() == RunResult::Completed && detected == pulses && sim.pulses() == pulses;
+        ok &= report(name + " period " + std::to_string(static_cast<int>(periodUs)) + " noise " +
+                         std::to_string(noise).substr(0, 3) + " pulses " + std::to_string(pulses) + " run " +
+                         std::to_string(run),
+                     good, counts(pump.lastResult(), detected, sim.pulses()));
+    }
+    return ok;
+}
+
+// periods with at least 2*lookahead+1 samples per pulse, see MonitoredPump
+template<typename Pump>
+bool checkWarmUp(const std::string& name, std::initializer_list<float> periods) {
+    bool ok = true;
+    for (float period : periods) {
+        for (float noise : {0.f, 0.5f}) {
+            for (uint32_t pulses : {1u, 6u, 200u}) {
+                ok &= checkRuns<Pump>(name, period, noise, pulses);
+            }
+        }
+    }
+    return ok;
+}
+
+uint32_t samplesPerPulse(float periodUs) {
+    return static_cast<uint32_t>(periodUs / 2 / SamplePeriodUs);
+}
+
+// ---- predictive stop -------------------------------------------------------
+
+// From the default offset on, no run may cut the power before the last
+// pulse was seen.
+bool checkPredictiveStop() {
+    const SimulatedPumpConfig c = simConfig(40000, 0.f);
+    SimulatedPump sim(c);
+    MonitoredPump<3> pump(c.enablePin, c.touchPin, 10.f, samplesPerPulse(c.periodUs));
+    pump.begin();
+    pump.setPredictiveStop(true);
+    bool ok = true;
+    for (int run = 0; run < 6; ++run) {
+        sim.resetPulses();
+        pump.runForPulses(20);
+        const PumpDiagnostics& d = pump.getDiagnostics();
+        ok &= report("predictive stop run " + std::to_string(run),
+                     pump.lastResult() == RunResult::Completed && d.predictedStop && d.pulseCount() == 20 &&
+                         sim.pulses() == 20,
+                     counts(pump.lastResult(), d.pulseCount(), sim.pulses()) + " error " +
+                         std::to_string(d.stopErrorUs));
+    }
+    return ok;
+}
+
+// ---- AsyncMonitoredPump -----------------------------------------------------
+
+bool checkAsync() {
+    const SimulatedPumpConfig c = simConfig(40000, 0.5f);
+    SimulatedPump sim(c);
+    AsyncMonitoredPump<3> pump(c.enablePin, c.touchPin, 10.f, samplesPerPulse(c.periodUs));
+    pump.begin();
+    bool ok = true;
+    for (int run = 0; run < 3; ++run) {
+        sim.resetPulses();
+        const bool started = pump.runForPulses(50);
+        pump.waitFinished();
+        const uint32_t detected = pump.getDiagnostics().pulseCount();
+        ok &= report("async run " + std::to_string(run),
+                     started && pump.lastResult() == RunResult::Completed && detected == 50 && sim.pulses() == 50,
+                     counts(pump.lastResult(), detected, sim.pulses()));
+    }
+    // stop() cuts the power and ends the run as aborted
+    sim.resetPulses();
+    const uint64_t stopAtUs = pumphal::host::nowUs() + 10 * static_cast<uint64_t>(c.periodUs);
+    pump.runForPulses(1000);
+    // the simulator is only safe to read once the worker is done, wait on the clock
+    while (pumphal::host::nowUs() < stopAtUs) std::this_thread::yield();
+    pump.stop();
+    const bool stopped = pump.isFinished() && pumphal::host::pinLevel(c.enablePin) == LOW;
+    ok &= report("async stop", stopped && pump.lastResult() == RunResult::Aborted && sim.pulses() < 1000,
+                 counts(pump.lastResult(), pump.getDiagnostics().pulseCount(), sim.pulses()));
+    // stopped before the worker picks the run up: never switched on
+    sim.resetPulses();
+    pump.runForPulses(50);
+    pump.stop();
+    pump.waitFinished();
+    ok &= report("async stop at once", pump.lastResult() == RunResult::Aborted && sim.pulses() == 0,
+                 counts(pump.lastResult(), 0, sim.pulses()));
+    // a refused request completes without a run
+    pump.runForPulses(0);
+    pump.waitFinished();
+    ok &= report("async refused", pump.isFinished() && pump.lastResult() == RunResult::InvalidRequest,
+                 "result " + std::to_string(static_cast<int>(pump.lastResult())));
+    // destroyed right after a run, and while running: the worker must be
+    // gone before the object is
+    for (int i = 0; i < 20; ++i) {
+        AsyncMonitoredPump<3> temporary(c.enablePin, c.touchPin, 10.f, samplesPerPulse(c.periodUs));
+        temporary.begin();
+        temporary.runForPulses(i % 2 ? 1000 : 2);
+        if (i % 2 == 0) temporary.waitFinished();
+    }
+    ok &= report("async destroy", pumphal::host::pinLevel(c.enablePin) == LOW, "20 pumps");
+    return ok;
+}
+
+// ---- PumpScheduler ----------------------------------------------------------
+
+bool checkScheduler() {
+    constexpr std::size_t N = 4;
+    std::vector<std::unique_ptr<SimulatedPump>> sims;
+    std::vector<std::unique_ptr<MonitoredPump<3>>> pumps;
+    PumpScheduler<N> scheduler;
+    for (std::size_t i = 0; i < N; ++i) {
+        const SimulatedPumpConfig c = simConfig(30000 + 10000 * i, 0.5f, static_cast<uint8_t>(1 + i));
+        sims.emplace_back(new SimulatedPump(c));
+        pumps.emplace_back(new MonitoredPump<3>(c.enablePin, c.touchPin, 10.f, samplesPerPulse(c.periodUs)));
+        pumps.back()->begin();
+        scheduler.addPump(*pumps.back());
+    }
+    bool ok = true;
+    for (int run = 0; run < 2; ++run) {
+        for (std::size_t i = 0; i < N; ++i) {
+            sims[i]->resetPulses();
+            scheduler.startPulses(static_cast<int>(i), 20 + 10 * i);
+        }
+        // the second run loses a sweep to a read error now and then, those
+        // ticks give no sample
+        uint32_t ticks = 0;
+        bool busy = true;
+        while (busy) {
+            if (run == 1 && ++ticks % 25 == 0) pumphal::host::failTouchReadAll(1);
+            scheduler.tick();
+            pumphal::delay(2);
+            busy = false;
+            for (std::size_t i = 0; i < N; ++i) busy |= scheduler.isBusy(static_cast<int>(i));
+        }
+        for (std::size_t i = 0; i < N; ++i) {
+            const uint32_t pulses = 20 + 10 * i;
+            const RunResult result = scheduler.result(static_cast<int>(i));
+            const uint32_t detected = pumps[i]->getDiagnostics().pulseCount();
+            ok &= report("scheduler run " + std::to_string(run) + " pump " + std::to_string(i),
+                         result == RunResult::Completed && detected == pulses && sims[i]->pulses() == pulses,
+                         counts(result, detected, sims[i]->pulses()));
+        }
+    }
+    return ok;
+}
+
+// ---- DosingQueue ------------------------------------------------------------
+
+using Queue = DosingQueue<8>;
+
+struct Expected {
+    Queue::JobId id;
+    Queue::JobState state;
+    uint32_t pulses;
+};
+
+bool checkJobs(const std::string& name, const Queue& queue, std::initializer_list<Expected> expected) {
+    bool ok = true;
+    for (const Expected& x : expected) {
+        const Queue::JobReport& r = queue.report(x.id);
+        ok &= report(name + " job " + std::to_string(x.id), r.state == x.state && r.pulses == x.pulses,
+                     "state " + std::to_string(static_cast<int>(r.state)) + " result " +
+                         std::to_string(static_cast<int>(r.result)) + " pulses " + std::to_string(r.pulses));
+    }
+    return ok;
+}
+
+bool checkQueue() {
+    const SimulatedPumpConfig c1 = simConfig(40000, 0.5f, 1);
+    const SimulatedPumpConfig c2 = simConfig(30000, 0.5f, 2);
+    SimulatedPump sim1(c1);
+    SimulatedPump sim2(c2);
+    bool ok = true;
+    {
+        // synchronous pumps run their jobs inside update()
+        MonitoredPump<3> pump1(c1.enablePin, c1.touchPin, 10.f, samplesPerPulse(c1.periodUs));
+        MonitoredPump<3> pump2(c2.enablePin, c2.touchPin, 10.f, samplesPerPulse(c2.periodUs));
+        pump1.begin();
+        pump2.begin();
+        Queue queue;
+        const Queue::JobId a = queue.addJob(pump1, 5);
+        const Queue::JobId b = queue.addJob(pump2, 3);
+        const Queue::JobId d = queue.addJob(pump1, 2, {a, b});
+        // too small for a pulse: fails, and its dependent is skipped
+        const Queue::JobId e = queue.addJob(pump2, 0.01f);
+        const Queue::JobId f = queue.addJob(pump2, 1, {e});
+        const bool all = queue.runAll();
+        ok &= report("queue", !all && queue.hasFailures(), "runAll " + std::to_string(all));
+        ok &= checkJobs("queue", queue, {{a, Queue::JobState::Done, 50}, {b, Queue::JobState::Done, 30},
+                                         {d, Queue::JobState::Done, 20}, {e, Queue::JobState::Failed, 0},
+                                         {f, Queue::JobState::Skipped, 0}});
+        ok &= report("queue delivered", sim1.pulses() == 70 && sim2.pulses() == 30,
+                     "pump 1 " + std::to_string(sim1.pulses()) + " pump 2 " + std::to_string(sim2.pulses()));
+    }
+    {
+        // a predictive stop cut well before the last pulse: the job is not
+        // confirmed, but its dependent still runs. Without noise, so the
+        // signal frozen by the cut shows no peak of its own.
+        const SimulatedPumpConfig c3 = simConfig(40000, 0.f, 5);
+        SimulatedPump sim3(c3);
+        MonitoredPump<3> pump1(c3.enablePin, c3.touchPin, 10.f, samplesPerPulse(c3.periodUs));
+        MonitoredPump<3> pump2(c2.enablePin, c2.touchPin, 10.f, samplesPerPulse(c2.periodUs));
+        pump1.begin();
+        pump2.begin();
+        pump1.setPredictiveStop(true);
+        pump1.setStopOffsetUs(-4 * static_cast<int32_t>(SamplePeriodUs));
+        Queue queue;
+        const Queue::JobId a = queue.addJob(pump1, 2);
+        const Queue::JobId b = queue.addJob(pump2, 1, {a});
+        const bool all = queue.runAll();
+        ok &= report("queue unconfirmed", all && !queue.hasFailures(), "runAll " + std::to_string(all));
+        ok &= checkJobs("queue unconfirmed", queue, {{a, Queue::JobState::Unconfirmed, 19},
+                                                     {b, Queue::JobState::Done, 10}});
+    }
+    {
+        // async pumps, one after the other, polled without moving the
+        // virtual clock (see HostHal.h)
+        sim1.resetPulses();
+        sim2.resetPulses();
+        AsyncMonitoredPump<3> pump1(c1.enablePin, c1.touchPin, 10.f, samplesPerPulse(c1.periodUs));
+        AsyncMonitoredPump<3> pump2(c2.enablePin, c2.touchPin, 10.f, samplesPerPulse(c2.periodUs));
+        pump1.begin();
+        pump2.begin();
+        Queue queue;
+        const Queue::JobId a = queue.addJob(pump1, 4);
+        const Queue::JobId b = queue.addJob(pump2, 2, {a});
+        const Queue::JobId d = queue.addJob(pump1, 1, {b});
+        while (!queue.isDone()) {
+            queue.update();
+            std::this_thread::yield();
+        }
+        ok &= report("async queue", !queue.hasFailures(), "failures " + std::to_string(queue.hasFailures()));
+        ok &= checkJobs("async queue", queue, {{a, Queue::JobState::Done, 40}, {b, Queue::JobState::Done, 20},
+                                               {d, Queue::JobState::Done, 10}});
+        ok &= report("async queue delivered", sim1.pulses() == 50 && sim2.pulses() == 20,
+                     "pump 1 " + std::to_string(sim1.pulses()) + " pump 2 " + std::to_string(sim2.pulses()));
+    }
+    return ok;
+}
+
+// ---- interrupt driven ---------------------------------------------------------
+
+CREATE_PUMP(counted, 30, 3, 0.1f)
+CREATE_FLOWMETER(meter, 31, 100.f, 1000)
+
+bool checkInterrupts() {
+    SimulatedPumpConfig c = simConfig(40000, 0.5f, 3);
+    c.interruptPin = 30;
+    SimulatedPump sim(c);
+    BEGIN_PUMP(counted);
+    bool ok = true;
+    for (int run = 0; run < 2; ++run) {
+        sim.resetPulses();
+        counted.runForMl(5);
+        while (counted.isBusy()) pumphal::delay(2);
+        ok &= report("pump run " + std::to_string(run), counted.getLastPulses() == 50 && sim.pulses() == 50,
+                     "requested " + std::to_string(counted.getLastPulses()) + " delivered " +
+                         std::to_string(sim.pulses()));
+    }
+
+    SimulatedPumpConfig m = simConfig(40000, 0.5f, 4);
+    m.interruptPin = 31;
+    SimulatedPump line(m);
+    BEGIN_FLOWMETER(meter);
+    pumphal::digitalWrite(m.enablePin, HIGH);
+    pumphal::delay(2000);
+    pumphal::digitalWrite(m.enablePin, LOW);
+    ok &= report("flow meter", meter.getTotalPulses() == line.pulses() && line.pulses() > 0,
+                 "counted " + std::to_string(meter.getTotalPulses()) + " delivered " + std::to_string(line.pulses()));
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    bool ok = true;
+    ok &= checkWarmUp<MonitoredPump<3>>("lookahead 3", {30000.f, 40000.f, 60000.f});
+    ok &= checkWarmUp<MonitoredPump<5>>("lookahead 5", {50000.f, 60000.f});
+    ok &= checkWarmUp<MonitoredPump<10, AdaptivePulseDetector<int32_t, 10>>>("adaptive", {20000.f, 30000.f, 40000.f, 60000.f});
+    ok &= checkPredictiveStop();
+    ok &= checkAsync();
+    ok &= checkScheduler();
+    ok &= checkQueue();
+    ok &= checkInterrupts();
+    std::printf("%s\n", ok ? "all ok" : "FAILED");
+    return ok ? 0 : 1;
+}
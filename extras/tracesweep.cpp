@@ -0,0 +1,428 @@
+// Replays recorded signal traces through the pulse detection and sweeps its
+// parameters, on all cores.
+//
+//   g++ -std=c++17 -O2 -I.. tracesweep.cpp ../HostHal.cpp ../MonitoredPump.cpp ../ShapeTrace.cpp -lpthread -o tracesweep
+//   ./tracesweep [options] trace... > sweep.csv
+//
+// Traces are either diagnostics files (DiagnosticsFormat.h, any number of
+// records per file; records without a full shape are skipped) or CSV in the
+// "sample,value,pulse" format of `diagdump --shape`. The pulse markers of a
+// trace are the reference the replays are scored against: the pulses found
+// on the device, or hand corrected ones.
+//
+// Every configuration of the grid replays every trace through
+//   pair  two PulseLookaheadDetector (peaks, and troughs inverted), as in
+//         the original MonitoredPump
+//   pump  MonitoredPump::processSample: fused detector, sub-sample timing
+//         and the baseline prefill
+// and gets one CSV line with the reference and detected pulse counts, the
+// count error per trace, missed and spurious pulses, the timing error of
+// the matched pulses (bias and jitter) and the detection latency.
+//
+// Options (lists are comma separated):
+//   --lookahead 2,5,10   Lookahead values, 1..20 (default 1,2,3,4,5,6,8,10,12,16,20)
+//   --decimation 1,2     replay every n-th sample only, i.e. slower sampling (default 1,2)
+//   --detector pair,pump (default both)
+//   --baseline recorded,first
+//                        pump prefill: the recorded baseline or the first
+//                        sample of the trace (default both)
+//   --threads n          (default: all cores)
+
+#include "../DiagnosticsFormat.h"
+#include "../PulseLookaheadDetector.h"
+#include "../AdaptivePulseDetector.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr unsigned long SamplePeriodUs = MonitoredPump<1>::SampleIntervalMs * 1000;
+constexpr std::size_t MaxLookahead = 20;
+
+struct Trace {
+    std::string name;
+    uint32_t baseline;           // added to the samples to get raw touch values
+    std::vector<int32_t> values;
+    std::vector<uint32_t> pulses; // reference pulse sample indices
+};
+
+// ---- loading --------------------------------------------------------------
+
+class FileSource {
+public:
+    explicit FileSource(FILE* f) : f_(f) {}
+    bool read(uint8_t* data, std::size_t size) {
+        return std::fread(data, 1, size, f_) == size;
+    }
+    bool atEnd() {
+        int c = std::fgetc(f_);
+        if (c == EOF) return true;
+        std::ungetc(c, f_);
+        return false;
+    }
+private:
+    FILE* f_;
+};
+
+// the samples must stay positive as raw touch values
+void fixBaseline(Trace& t) {
+    if (t.values.empty()) return;
+    const int32_t lowest = *std::min_element(t.values.begin(), t.values.end());
+    if (static_cast<int64_t>(t.baseline) + lowest < 1) {
+        t.baseline = static_cast<uint32_t>(1 - lowest);
+    }
+}
+
+bool loadRecords(FILE* f, const char* path, std::vector<Trace>& traces) {
+    FileSource source(f);
+    diagformat::Reader<FileSource> reader(source);
+    diagformat::Record r;
+    int index = 0;
+    while (!source.atEnd()) {
+        diagformat::Error e = reader.read(r);
+        if (e != diagformat::Error::None) {
+            std::fprintf(stderr, "%s: record %d unreadable\n", path, index);
+            return false;
+        }
+        if (!r.fullShape.empty()) {
+            Trace t;
+            t.name = std::string(path) + "#" + std::to_string(index);
+            t.baseline = r.baseline;
+            ShapeTrace::Reader samples = r.fullShape.reader();
+            int32_t value;
+            bool pulse;
+            while (samples.next(value, pulse)) {
+                if (pulse) t.pulses.push_back(static_cast<uint32_t>(t.values.size()));
+                t.values.push_back(value);
+            }
+            fixBaseline(t);
+            traces.push_back(std::move(t));
+        }
+        ++index;
+    }
+    return true;
+}
+
+bool loadCsv(FILE* f, const char* path, std::vector<Trace>& traces) {
+    Trace t;
+    t.name = path;
+    t.baseline = 0;
+    char line[256];
+    while (std::fgets(line, sizeof(line), f)) {
+        unsigned long sample;
+        long value;
+        int pulse;
+        // other lines (header, diagdump summary) are skipped
+        if (std::sscanf(line, "%lu,%ld,%d", &sample, &value, &pulse) != 3) continue;
+        if (pulse) t.pulses.push_back(static_cast<uint32_t>(t.values.size()));
+        t.values.push_back(static_cast<int32_t>(value));
+    }
+    if (t.values.empty()) {
+        std::fprintf(stderr, "%s: no samples\n", path);
+        return false;
+    }
+    fixBaseline(t);
+    traces.push_back(std::move(t));
+    return true;
+}
+
+bool load(const char* path, std::vector<Trace>& traces) {
+    FILE* f = std::fopen(path, "rb");
+    if (!f) {
+        std::perror(path);
+        return false;
+    }
+    uint8_t magic[sizeof(diagformat::Magic)] = {};
+    const bool binary = std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                        std::memcmp(magic, diagformat::Magic, sizeof(magic)) == 0;
+    std::rewind(f);
+    bool ok = binary ? loadRecords(f, path, traces) : loadCsv(f, path, traces);
+    std::fclose(f);
+    return ok;
+}
+
+// ---- replay ---------------------------------------------------------------
+
+enum class DetectorKind { Pair, Pump };
+enum class BaselineMode { Recorded, First };
+
+struct Config {
+    DetectorKind detector;
+    std::size_t lookahead;
+    std::size_t decimation;
+    BaselineMode baseline;
+};
+
+struct Score {
+    uint64_t reference = 0;
+    uint64_t detected = 0;
+    uint64_t missed = 0;
+    uint64_t spurious = 0;
+    RunningStats countError;   // detected - reference per trace
+    RunningStats timingError;  // detected - reference time of matched pulses
+    RunningStats latency;      // detection time - reference time
+};
+
+struct Detection {
+    float timeUs;      // time of the pulse
+    float detectedUs;  // time of the sample it was reported at
+};
+
+template<std::size_t L>
+void replayPair(const Trace& t, std::size_t decimation, std::vector<Detection>& out) {
+    PulseLookaheadDetector<int32_t, L> peaks(false);
+    PulseLookaheadDetector<int32_t, L> troughs(true);
+    for (std::size_t i = 0; i < t.values.size(); i += decimation) {
+        const int32_t raw = t.values[i] + static_cast<int32_t>(t.baseline);
+        const bool peak = peaks.addSample(raw);
+        const bool trough = troughs.addSample(raw);
+        if (peak || trough) {
+            // reported for the center sample, L replayed samples back
+            out.push_back({static_cast<float>((i - L * decimation) * SamplePeriodUs),
+                           static_cast<float>(i * SamplePeriodUs)});
+        }
+    }
+}
+
+void replayPair(const Trace& t, const Config& c, std::vector<Detection>& out) {
+    switch (c.lookahead) {
+        case 1: replayPair<1>(t, c.decimation, out); break;
+        case 2: replayPair<2>(t, c.decimation, out); break;
+        case 3: replayPair<3>(t, c.decimation, out); break;
+        case 4: replayPair<4>(t, c.decimation, out); break;
+        case 5: replayPair<5>(t, c.decimation, out); break;
+        case 6: replayPair<6>(t, c.decimation, out); break;
+        case 8: replayPair<8>(t, c.decimation, out); break;
+        case 10: replayPair<10>(t, c.decimation, out); break;
+        case 12: replayPair<12>(t, c.decimation, out); break;
+        case 16: replayPair<16>(t, c.decimation, out); break;
+        case 20: replayPair<20>(t, c.decimation, out); break;
+    }
+}
+
+using ReplayPump = MonitoredPump<MaxLookahead, AdaptivePulseDetector<int32_t, MaxLookahead>>;
+
+void replayPump(const Trace& t, const Config& c, std::vector<Detection>& out) {
+    ReplayPump pump(0, 0, 1.0f);
+    PumpCalibration calibration;
+    calibration.baseline = c.baseline == BaselineMode::First && !t.values.empty()
+                               ? t.values[0] + t.baseline : t.baseline;
+    // the adaptive detector uses just under half the samples per pulse as lookahead
+    calibration.samplesPerPulse = static_cast<uint32_t>(2 * c.lookahead + 1);
+    pump.applyCalibration(calibration);
+    // there is no pad behind the replay, keep the baseline as applied
+    pump.setIdleReadAtStart(false);
+    pump.setKeepPulseHistory(true);
+    // more pulses than replayed samples, so the run never completes before
+    // the trace ends; bounded, as beginRun reserves the history for it
+    const uint32_t samples = static_cast<uint32_t>((t.values.size() + c.decimation - 1) / c.decimation);
+    if (!pump.beginRun(samples + 1, false, SamplePeriodUs * c.decimation)) return;
+    const PumpDiagnostics& d = pump.getDiagnostics();
+    uint32_t seen = 0;
+    for (std::size_t i = 0; i < t.values.size(); i += c.decimation) {
+        const unsigned long time = i * SamplePeriodUs;
+        pump.processSample(static_cast<uint32_t>(t.values[i] + static_cast<int32_t>(t.baseline)), time);
+        for (; seen < d.pulseTimes.size(); ++seen) {
+            out.push_back({static_cast<float>(d.pulseTimes[seen]), static_cast<float>(time)});
+        }
+    }
+    pump.endRun(RunResult::Aborted);
+}
+
+// Matches detections to the reference pulses in time order. Two pulses
+// closer than tolerance are the same.
+void score(const Trace& t, const std::vector<Detection>& detections, Score& s) {
+    std::vector<float> reference(t.pulses.size());
+    for (std::size_t i = 0; i < t.pulses.size(); ++i) {
+        reference[i] = static_cast<float>(t.pulses[i] * SamplePeriodUs);
+    }
+    // half the typical distance of two reference pulses
+    float tolerance = 0;
+    if (reference.size() > 1) {
+        std::vector<float> intervals(reference.size() - 1);
+        for (std::size_t i = 1; i < reference.size(); ++i) intervals[i - 1] = reference[i] - reference[i - 1];
+        std::nth_element(intervals.begin(), intervals.begin() + intervals.size() / 2, intervals.end());
+        tolerance = intervals[intervals.size() / 2] / 2;
+    }
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i < reference.size() && j < detections.size()) {
+        const float error = detections[j].timeUs - reference[i];
+        if (error <= tolerance && error >= -tolerance) {
+            s.timingError.add(error);
+            s.latency.add(detections[j].detectedUs - reference[i]);
+            ++i;
+            ++j;
+        } else if (error < 0) {
+            ++s.spurious;
+            ++j;
+        } else {
+            ++s.missed;
+            ++i;
+        }
+    }
+    s.missed += reference.size() - i;
+    s.spurious += detections.size() - j;
+    s.reference += reference.size();
+    s.detected += detections.size();
+    s.countError.add(static_cast<float>(detections.size()) - static_cast<float>(reference.size()));
+}
+
+Score run(const Config& c, const std::vector<Trace>& traces) {
+    Score s;
+    std::vector<Detection> detections;
+    for (const Trace& t : traces) {
+        detections.clear();
+        if (c.detector == DetectorKind::Pair) {
+            replayPair(t, c, detections);
+        } else {
+            replayPump(t, c, detections);
+        }
+        score(t, detections, s);
+    }
+    return s;
+}
+
+// ---- command line ---------------------------------------------------------
+
+std::vector<std::string> split(const char* list) {
+    std::vector<std::string> items;
+    std::string item;
+    for (const char* p = list;; ++p) {
+        if (*p == ',' || *p == 0) {
+            if (!item.empty()) items.push_back(item);
+            item.clear();
+            if (*p == 0) break;
+        } else {
+            item += *p;
+        }
+    }
+    return items;
+}
+
+bool supportedLookahead(std::size_t l) {
+    static const std::size_t supported[] = {1, 2, 3, 4, 5, 6, 8, 10, 12, 16, 20};
+    return std::find(std::begin(supported), std::end(supported), l) != std::end(supported);
+}
+
+int usage(const char* self) {
+    std::fprintf(stderr, "usage: %s [--lookahead l,...] [--decimation n,...] [--detector pair,pump]\n"
+                         "       [--baseline recorded,first] [--threads n] trace...\n", self);
+    return 2;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::vector<std::size_t> lookaheads = {1, 2, 3, 4, 5, 6, 8, 10, 12, 16, 20};
+    std::vector<std::size_t> decimations = {1, 2};
+    std::vector<DetectorKind> detectors = {DetectorKind::Pair, DetectorKind::Pump};
+    std::vector<BaselineMode> baselines = {BaselineMode::Recorded, BaselineMode::First};
+    unsigned threads = std::thread::hardware_concurrency();
+    std::vector<Trace> traces;
+
+    for (int i = 1; i < argc; ++i) {
+        const bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--lookahead") == 0 && hasValue) {
+            lookaheads.clear();
+            for (const std::string& v : split(argv[++i])) {
+                std::size_t l = std::strtoul(v.c_str(), nullptr, 10);
+                if (!supportedLookahead(l)) {
+                    std::fprintf(stderr, "unsupported lookahead %s\n", v.c_str());
+                    return 2;
+                }
+                lookaheads.push_back(l);
+            }
+        } else if (std::strcmp(argv[i], "--decimation") == 0 && hasValue) {
+            decimations.clear();
+            for (const std::string& v : split(argv[++i])) {
+                std::size_t n = std::strtoul(v.c_str(), nullptr, 10);
+                if (n == 0) return usage(argv[0]);
+                decimations.push_back(n);
+            }
+        } else if (std::strcmp(argv[i], "--detector") == 0 && hasValue) {
+            detectors.clear();
+            for (const std::string& v : split(argv[++i])) {
+                if (v == "pair") detectors.push_back(DetectorKind::Pair);
+                else if (v == "pump") detectors.push_back(DetectorKind::Pump);
+                else return usage(argv[0]);
+            }
+        } else if (std::strcmp(argv[i], "--baseline") == 0 && hasValue) {
+            baselines.clear();
+            for (const std::string& v : split(argv[++i])) {
+                if (v == "recorded") baselines.push_back(BaselineMode::Recorded);
+                else if (v == "first") baselines.push_back(BaselineMode::First);
+                else return usage(argv[0]);
+            }
+        } else if (std::strcmp(argv[i], "--threads") == 0 && hasValue) {
+            threads = std::strtoul(argv[++i], nullptr, 10);
+        } else if (argv[i][0] == '-') {
+            return usage(argv[0]);
+        } else if (!load(argv[i], traces)) {
+            return 1;
+        }
+    }
+    if (traces.empty() || lookaheads.empty() || decimations.empty() ||
+        detectors.empty() || baselines.empty()) {
+        return usage(argv[0]);
+    }
+    if (threads == 0) threads = 1;
+
+    // the baseline only matters for the pump prefill
+    std::vector<Config> grid;
+    for (DetectorKind detector : detectors) {
+        for (std::size_t lookahead : lookaheads) {
+            for (std::size_t decimation : decimations) {
+                if (detector == DetectorKind::Pair) {
+                    grid.push_back({detector, lookahead, decimation, BaselineMode::Recorded});
+                    continue;
+                }
+                for (BaselineMode baseline : baselines) {
+                    grid.push_back({detector, lookahead, decimation, baseline});
+                }
+            }
+        }
+    }
+
+    // configurations are handed out one at a time, the traces are shared read-only
+    std::vector<Score> scores(grid.size());
+    std::atomic<std::size_t> next{0};
+    auto worker = [&] {
+        for (std::size_t c = next++; c < grid.size(); c = next++) {
+            scores[c] = run(grid[c], traces);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads && i < grid.size(); ++i) pool.emplace_back(worker);
+    worker();
+    for (std::thread& t : pool) t.join();
+
+    std::size_t samples = 0;
+    for (const Trace& t : traces) samples += t.values.size();
+    std::fprintf(stderr, "%zu traces, %zu samples, %zu configurations\n", traces.size(), samples, grid.size());
+
+    std::printf("detector,lookahead,decimation,baseline,traces,reference,detected,"
+                "count_error_mean,count_error_max,missed,spurious,"
+                "timing_bias_us,timing_jitter_us,latency_mean_us,latency_max_us\n");
+    for (std::size_t c = 0; c < grid.size(); ++c) {
+        const Config& g = grid[c];
+        const Score& s = scores[c];
+        const float countErrorMax = std::max(std::fabs(s.countError.lowest()), std::fabs(s.countError.highest()));
+        std::printf("%s,%zu,%zu,%s,%zu,%llu,%llu,%.3f,%.0f,%llu,%llu,%.1f,%.1f,%.1f,%.1f\n",
+                    g.detector == DetectorKind::Pair ? "pair" : "pump", g.lookahead, g.decimation,
+                    g.detector == DetectorKind::Pair ? "-" : g.baseline == BaselineMode::Recorded ? "recorded" : "first",
+                    traces.size(), static_cast<unsigned long long>(s.reference),
+                    static_cast<unsigned long long>(s.detected), s.countError.mean(), countErrorMax,
+                    static_cast<unsigned long long>(s.missed), static_cast<unsigned long long>(s.spurious),
+                    s.timingError.mean(), s.timingError.deviation(), s.latency.mean(), s.latency.highest());
+    }
+    return 0;
+}